@@ -93,6 +93,7 @@ public:
             if (fireEvents)
                 onUpdate(newValue);
             lastUpdate = std::chrono::system_clock::now();
+            lastSample = std::chrono::steady_clock::now();
         }
     }
 
@@ -116,6 +117,12 @@ public:
         return lastChange;
     }
 
+    //When the current value was read from the game, monotonic so it can go into transport message stamps
+    std::chrono::steady_clock::time_point getLastSample() const {
+        std::unique_lock lock(valueMutex);
+        return lastSample;
+    }
+
 
 private:
 
@@ -136,6 +143,7 @@ private:
                 std::shared_ptr<const CachedValueMT<Type>> lockedValue = value.lock();
                 if (!lockedValue) return;
                 auto newValue = lockedValue->updateFunc();
+                const auto sampleTime = std::chrono::steady_clock::now();
                 std::unique_lock lock(lockedValue->valueMutex);
                 if (newValue != lockedValue->value) {
                     lockedValue->onUpdate(newValue);
@@ -143,6 +151,7 @@ private:
                 }
                 lockedValue->value = newValue;
                 lockedValue->lastUpdate = std::chrono::system_clock::now();
+                lockedValue->lastSample = sampleTime;
             });
         }
         else {
@@ -164,6 +173,7 @@ private:
 
     mutable std::chrono::system_clock::time_point lastUpdate;
     mutable std::chrono::system_clock::time_point lastChange;
+    mutable std::chrono::steady_clock::time_point lastSample; //Guarded by valueMutex
     mutable std::recursive_mutex valueMutex;
     mutable Type value;
     Signal<void(const Type&)> onUpdate;
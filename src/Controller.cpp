@@ -1,4 +1,5 @@
 #include "Controller.hpp"
+#include <algorithm>
 #include <unordered_set>
 #include <future>
 
@@ -7,6 +8,27 @@ static inline __itt_domain* ControllerDomain = __itt_domain_create("Controller")
 static inline __itt_string_handle* Controller_processPlayerPositions = __itt_string_handle_create("processPlayerPositions");
 static inline __itt_string_handle* Controller_updatePlayerlist = __itt_string_handle_create("updatePlayerlist");
 static inline __itt_string_handle* Controller_sendSpeakers = __itt_string_handle_create("sendSpeakers");
+static inline __itt_string_handle* Controller_flushPositionBatch = __itt_string_handle_create("flushPositionBatch");
+
+//All POS records of one worker tick are sent as one sync request
+//"POSBATCH" followed by one or more "\x1E" + "POS\t..." records, TeamSpeak answers once for the whole frame.
+//Only if both sides support TransportCapability::PositionBatches, otherwise every "POS\t..." record is sent alone
+//"POSBATCHB" followed by one or more BinaryPositionRecord, if both sides support TransportCapability::BinaryPositions
+//"POSBATCHD" followed by one or more delta records, if both sides support TransportCapability::PositionDeltas
+static constexpr std::string_view positionBatchHeader = "POSBATCH"sv;
+static constexpr std::string_view positionBatchBinaryHeader = "POSBATCHB"sv;
+static constexpr std::string_view positionBatchDeltaHeader = "POSBATCHD"sv;
+static constexpr char positionBatchSeparator = '\x1E';
+static constexpr auto positionKeyframeInterval = 2s;
+
+static std::string_view getPositionBatchHeader(Controller::PositionBatchMode mode) {
+    switch (mode) {
+        case Controller::PositionBatchMode::Binary: return positionBatchBinaryHeader;
+        case Controller::PositionBatchMode::Delta: return positionBatchDeltaHeader;
+        case Controller::PositionBatchMode::Single: return {};
+        default: return positionBatchHeader;
+    }
+}
 
 Controller::Controller() : playerUpdateScheduler(std::make_shared<MainthreadScheduler>()) {
     
@@ -33,6 +55,83 @@ void Controller::preStart() {
         return {};
         });
 
+    //"path" starts capturing all transport traffic into that file, "" stops. Returns the error message, "" on success
+    CBAIface->registerNativeFunction("TFAR_fnc_transportCapture"sv, [](game_value_parameter args) -> game_value {
+        const std::string path(static_cast<r_string>(args));
+        if (path.empty()) {
+            Transport::stopCapture();
+            return ""sv;
+        }
+        std::string error;
+        if (!Transport::startCapture(path, error))
+            return error;
+        return ""sv;
+        });
+
+    //Returns [[name, value], ...], syncLatency is the histogram, entry i counts round trips faster than 2^i microseconds
+    //lane* entries are [Control, Realtime, Bulk]. laneDataAge is how old the data of the last consumed message was,
+    //the averages are over every stamped message, all in microseconds. Empty if TeamSpeak doesn't do MessageTimestamps.
+    //mappingMode is the MemMapMode bits the shared memory got, mappingFaults the page faults it took to set it up
+    CBAIface->registerNativeFunction("TFAR_fnc_transportTelemetry"sv, [this](game_value_parameter) -> game_value {
+        SharedMemoryHandlerInternal::TransportTelemetry telemetry;
+        if (!networkHandler->getTelemetry(telemetry)) return {};
+
+        auto counter = [](std::string_view name, const auto& value) -> game_value {
+            return { name, static_cast<float>(value.load(std::memory_order_relaxed)) };
+        };
+        auto_array<game_value> latency;
+        for (auto& it : telemetry.syncLatency)
+            latency.emplace_back(static_cast<float>(it.load(std::memory_order_relaxed)));
+        auto perLane = [](std::string_view name, const auto& values) -> game_value {
+            auto_array<game_value> lanes;
+            for (auto& it : values)
+                lanes.emplace_back(static_cast<float>(it.load(std::memory_order_relaxed)));
+            return { name, std::move(lanes) };
+        };
+
+        auto_array<game_value> dataAge, dataAgeAverage, queueDelayAverage;
+        SharedMemoryHandlerInternal::ConsumerTelemetry consumer;
+        if (networkHandler->getConsumerTelemetry(consumer)) {
+            for (size_t lane = 0; lane < MESSAGE_LANE_COUNT; ++lane) {
+                const auto messages = consumer.stampedMessages[lane].load(std::memory_order_relaxed);
+                auto average = [messages](const auto& total) {
+                    return messages ? static_cast<float>(total.load(std::memory_order_relaxed)) / messages : 0.f;
+                };
+                dataAge.emplace_back(static_cast<float>(consumer.lastDataAge[lane].load(std::memory_order_relaxed)));
+                dataAgeAverage.emplace_back(average(consumer.dataAgeTotal[lane]));
+                queueDelayAverage.emplace_back(average(consumer.queueDelayTotal[lane]));
+            }
+        }
+
+        return {
+            counter("asyncEnqueued"sv, telemetry.asyncEnqueued),
+            counter("asyncEnqueuedBytes"sv, telemetry.asyncEnqueuedBytes),
+            counter("asyncDropped"sv, telemetry.asyncDropped),
+            counter("asyncRejected"sv, telemetry.asyncRejected),
+            counter("asyncHighWater"sv, telemetry.asyncHighWater),
+            counter("asyncCompressed"sv, telemetry.asyncCompressed),
+            counter("asyncCompressedBytesSaved"sv, telemetry.asyncCompressedBytesSaved),
+            counter("syncRequests"sv, telemetry.syncRequests),
+            counter("syncTimeouts"sv, telemetry.syncTimeouts),
+            counter("pipelinedRequests"sv, telemetry.pipelinedRequests),
+            counter("pipelinedTimeouts"sv, telemetry.pipelinedTimeouts),
+            counter("mappingMode"sv, telemetry.mappingMode),
+            counter("mappingFaults"sv, telemetry.mappingFaults),
+            game_value{ "negotiatedCapabilities"sv, static_cast<float>(networkHandler->getNegotiatedCapabilities()) },
+            perLane("laneEnqueued"sv, telemetry.laneEnqueued),
+            perLane("laneDropped"sv, telemetry.laneDropped),
+            perLane("laneHighWater"sv, telemetry.laneHighWater),
+            game_value{ "laneDataAge"sv, std::move(dataAge) },
+            game_value{ "laneDataAgeAverage"sv, std::move(dataAgeAverage) },
+            game_value{ "laneQueueDelayAverage"sv, std::move(queueDelayAverage) },
+            game_value{ "syncLatency"sv, std::move(latency) }
+        };
+        });
+
+    networkHandler->onNewSession.connect([this]() { //Worker thread, from pollCompletions
+        fullStateResendPending = true;
+    });
+
     workerThread = std::make_unique<std::thread>([this]() {
         threadWork();
     });
@@ -153,8 +252,21 @@ void Controller::updatePlayerlist() {
 void Controller::threadWork() {
     std::chrono::system_clock::time_point lastSpeakerUpdate;
     std::string lastSpeakerInfo;
+    std::string speakerInfo; //Reused, no allocation once warmed up
+
+    auto buildSpeakers = [this](std::string& data) {
+        data += "SPEAKERS\t"sv;
+        for (auto& it : players)
+            if (it)
+                it->grabRadios(data);
+        if (std::string_view(data).back() == '\xB')
+            data.pop_back();
+        data += '~'; //async command
+    };
 
     while (true) {
+        networkHandler->pollCompletions(); //Also without players, it notices a restarted TeamSpeak
+
         if (players.empty()) {
             std::this_thread::sleep_for(1s);
             continue;
@@ -162,34 +274,39 @@ void Controller::threadWork() {
 
         std::shared_lock lock(playersLock);
 
+        if (fullStateResendPending) {
+            fullStateResendPending = false;
+            for (auto& it : players)
+                if (it)
+                    it->resendFullState();
+            lastSpeakerInfo.clear();
+        }
+
         for (auto& it : players) {
             if (it) //it happened once
                 it->simulate();
         }
+        flushPositionBatch();
 
         if (std::chrono::system_clock::now() - lastSpeakerUpdate > 200ms) {
             ittScope sc(ControllerDomain, Controller_sendSpeakers);
-            auto_array<r_string> radioData; //#TODO use std::string and vector
-
-            for (auto& it : players)
-                if (it)
-                    it->grabRadios(radioData);
-
             //#TODO add ground radios from cached value in controller
 
-            std::string data;
-            data += "SPEAKERS\t";
-            for (auto& it : radioData) {
-                data += it;
-                data += "\xB";
+            //The frame is as old as the oldest radio list in it
+            auto radiosSampled = std::chrono::steady_clock::time_point::max();
+            for (auto& it : players)
+                if (it && it->radioUpdate)
+                    radiosSampled = (std::min)(radiosSampled, it->radioUpdate->getLastSample());
+            if (radiosSampled == std::chrono::steady_clock::time_point::max())
+                radiosSampled = {};
+
+            //Collect first, a claim in the arena would hold back every later Bulk message while the radios are walked
+            speakerInfo.clear();
+            buildSpeakers(speakerInfo);
+            if (speakerInfo != lastSpeakerInfo) { //Don't bother teamspeak if nothing changed
+                networkHandler->doAsyncRequest(speakerInfo, "SPEAKERS", MessageLane::Bulk, radiosSampled); //Older unread SPEAKERS are outdated now
+                std::swap(speakerInfo, lastSpeakerInfo);
             }
-            if (!radioData.empty())
-                data.pop_back();
-            data += "~"; //async command
-
-            if (data != lastSpeakerInfo) //Don't bother teamspeak if nothing changed
-                networkHandler.doAsyncRequest(data);
-            lastSpeakerInfo = std::move(data);
         }
         lock.unlock();
 
@@ -198,3 +315,102 @@ void Controller::threadWork() {
     }
 
 }
+
+void Controller::appendPositionRecord(PlayerInfo& player, const PositionUpdate& update, std::chrono::steady_clock::time_point captureTime) {
+    if (positionBatch.empty()) {
+        positionBatchCaptureTime = std::chrono::steady_clock::time_point::max();
+        positionBatchMode = PositionBatchMode::Text;
+        //Most compact encoding both sides support
+        if (networkHandler->isCapabilityActive(TransportCapability::PositionDeltas))
+            positionBatchMode = PositionBatchMode::Delta;
+        else if (networkHandler->isCapabilityActive(TransportCapability::BinaryPositions))
+            positionBatchMode = PositionBatchMode::Binary;
+        else if (!networkHandler->isCapabilityActive(TransportCapability::PositionBatches))
+            positionBatchMode = PositionBatchMode::Single;
+        positionBatch.reserve(SHAREDMEM_MAX_STRINGSIZE);
+        positionBatch += getPositionBatchHeader(positionBatchMode);
+    }
+    const auto headerLength = getPositionBatchHeader(positionBatchMode).length();
+
+    auto oldLength = positionBatch.length();
+    const auto oldCaptureTime = positionBatchCaptureTime;
+    positionBatchCaptureTime = (std::min)(positionBatchCaptureTime, captureTime);
+    switch (positionBatchMode) {
+        case PositionBatchMode::Single:
+            PositionRecord::encodeText(update, positionBatch);
+            flushPositionBatch();
+            return;
+        case PositionBatchMode::Text:
+            positionBatch += positionBatchSeparator;
+            PositionRecord::encodeText(update, positionBatch);
+            break;
+        case PositionBatchMode::Binary:
+            PositionRecord::encodeBinary(update, positionBatch);
+            break;
+        case PositionBatchMode::Delta: {
+            //TeamSpeak processes frames in order, so the delta is against what we sent last
+            auto now = std::chrono::steady_clock::now();
+            bool keyframe = !player.hasPositionBaseline || now - player.lastPositionKeyframe > positionKeyframeInterval;
+            if (keyframe)
+                player.lastPositionKeyframe = now;
+            PositionRecord::encodeDelta(update, keyframe ? nullptr : &player.sentPosition, positionBatch);
+            player.sentPosition.assign(update);
+            player.hasPositionBaseline = true;
+            positionBatchPlayers.emplace_back(player.weak_from_this());
+        } break;
+    }
+
+    if (positionBatch.length() > SHAREDMEM_MAX_STRINGSIZE && oldLength > headerLength) {
+        //Frame is full, send what we had and start a new one with this record
+        std::string frameStart = positionBatch.substr(0, headerLength);
+        std::string record = positionBatch.substr(oldLength);
+        positionBatch.resize(oldLength);
+        std::weak_ptr<PlayerInfo> recordPlayer;
+        if (positionBatchMode == PositionBatchMode::Delta) {
+            recordPlayer = std::move(positionBatchPlayers.back());
+            positionBatchPlayers.pop_back();
+        }
+        positionBatchCaptureTime = oldCaptureTime;
+        flushPositionBatch();
+        positionBatch = std::move(frameStart);
+        positionBatch += record;
+        positionBatchCaptureTime = captureTime;
+        if (positionBatchMode == PositionBatchMode::Delta)
+            positionBatchPlayers.emplace_back(std::move(recordPlayer));
+    }
+}
+
+void Controller::flushPositionBatch() {
+    if (positionBatch.length() <= getPositionBatchHeader(positionBatchMode).length()) { //No records
+        positionBatch.clear();
+        return;
+    }
+    ittScope sc(ControllerDomain, Controller_flushPositionBatch);
+
+    Transport::RequestCallback onAnswer;
+    if (!positionBatchPlayers.empty()) {
+        onAnswer = [players = std::move(positionBatchPlayers)](bool success, std::string_view) {
+            if (success) return;
+            //We don't know what TeamSpeak got, next update has to be a keyframe
+            for (auto& weakPlayer : players)
+                if (auto player = weakPlayer.lock())
+                    player->hasPositionBaseline = false;
+        };
+        positionBatchPlayers.clear();
+    }
+
+    //Don't wait for TeamSpeak, a slow answer would stall every other player's updates
+    const bool pipelined = networkHandler->isCapabilityActive(TransportCapability::PipelinedRequests);
+    if (pipelined && networkHandler->doPipelinedRequest(positionBatch, onAnswer, MessageLane::Realtime, positionBatchCaptureTime)) {
+        positionBatch.clear();
+        return;
+    }
+
+    //TeamSpeak doesn't answer requests, or too many are in flight. On the same lane this can't overtake the
+    //frames still queued, a sync request would
+    const bool queued = networkHandler->doAsyncRequest(positionBatch, MessageLane::Realtime, positionBatchCaptureTime);
+    //Unanswered while requests pile up, we don't know if TeamSpeak took it. Deltas start over with a keyframe
+    if (onAnswer && (!queued || pipelined))
+        onAnswer(false, {});
+    positionBatch.clear();
+}
@@ -3,6 +3,7 @@
 #include <shared_mutex>
 #include <intercept.hpp>
 #include "PlayerInfo.hpp"
+#include "PositionRecord.hpp"
 #include "MainthreadScheduler.hpp"
 #include "../intercept/src/host/common/singleton.hpp"
 #include "SharedMemoryTransfer.hpp"
@@ -35,6 +36,10 @@ public:
 
     void threadWork();
 
+    //Called by PlayerInfo::sendToTeamspeak on the worker thread
+    //captureTime is when the position in update was sampled
+    void appendPositionRecord(PlayerInfo& player, const PositionUpdate& update, std::chrono::steady_clock::time_point captureTime);
+    void flushPositionBatch();
 
 
     CachedValueMTS<bool> objectInterceptionEnabled;
@@ -51,6 +56,21 @@ public:
     NativeFunctionPluginInterface* CBAIface;
     std::shared_ptr<MainthreadScheduler> playerUpdateScheduler;
     std::unique_ptr<std::thread> workerThread;
-    SharedMemoryHandler networkHandler;
+    std::unique_ptr<Transport> networkHandler = Transport::createFromEnvironment();
+    //Only touched by worker thread
+    enum class PositionBatchMode {
+        Single, //TeamSpeak can't split frames, every record is sent on its own
+        Text,
+        Binary,
+        Delta
+    };
+    std::string positionBatch;
+    PositionBatchMode positionBatchMode = PositionBatchMode::Text;
+    //Players in the current delta batch, they need a keyframe if TeamSpeak doesn't acknowledge it
+    std::vector<std::weak_ptr<PlayerInfo>> positionBatchPlayers;
+    //Oldest sample in the current batch, the batch is as old as that
+    std::chrono::steady_clock::time_point positionBatchCaptureTime;
+    //Set by networkHandler.onNewSession, TeamSpeak lost everything we sent so far
+    bool fullStateResendPending = false;
 
 };
\ No newline at end of file
@@ -0,0 +1,280 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+namespace SharedMemoryHandlerInternal {
+
+	/*
+	Length prefixed, byte packed message ring inside the shared memory.
+	Every record is [uint32 length][payload] padded to ARENA_RECORD_ALIGN bytes so small messages sit right next to each other.
+	If a record doesn't fit before the end of the buffer, the producer writes ARENA_WRAP_MARKER as length and continues at offset 0.
+	Messages bigger than maxRecordSize are split into consecutive records, all but the last one have ARENA_FLAG_MORE_FRAGMENTS
+	set in their length.
+	The producer may set ARENA_FLAG_SKIP on the first record of a message it hasn't seen consumed yet, to replace it by a newer one.
+	The consumer then skips over all its fragments. Because of that, length words are accessed atomically.
+
+	Any number of producers in the same process. A producer claims the bytes for a whole message by advancing head with a CAS,
+	then fills them and publishes the message by storing the length word of its first record with ARENA_FLAG_COMMITTED last.
+	The consumer delivers messages in head order and stops at the first one that is claimed but not committed yet.
+	It zeroes every byte it consumed before advancing tail. A new record's length word can land on what was payload in the
+	previous lap, so clearing only the old length words isn't enough to make a claimed record start out uncommitted.
+
+	head and tail are free running byte counters, offset is counter % Capacity.
+	Only producers write head, only the consumer writes tail.
+
+	Neither side touches the other's cache line per message. The consumer reads ahead in readTail and publishes tail once
+	per batch, when it caught up with head or freed ARENA_RELEASE_FRACTION of the buffer. Producers check free space
+	against cachedTail and only load tail when that says the message doesn't fit. A producer may see less space than
+	there is, never more.
+	*/
+	constexpr uint32_t ARENA_RECORD_ALIGN = 8;
+	constexpr uint32_t ARENA_WRAP_MARKER = 0xFFFFFFFF;
+	constexpr uint32_t ARENA_FLAG_MORE_FRAGMENTS = 1u << 31;
+	constexpr uint32_t ARENA_FLAG_SKIP = 1u << 30;
+	constexpr uint32_t ARENA_FLAG_COMMITTED = 1u << 29;
+	constexpr uint32_t ARENA_LENGTH_MASK = (1u << 24) - 1;
+	constexpr uint32_t ARENA_RELEASE_FRACTION = 8; //Consumer publishes tail at least every Capacity / 8 bytes
+
+	template <uint32_t Capacity>
+	class MessageArena {
+		static_assert((Capacity & (Capacity - 1)) == 0, "MessageArena capacity must be power of two");
+		static_assert(Capacity % ARENA_RECORD_ALIGN == 0, "MessageArena capacity must be multiple of the record alignment");
+	public:
+		static constexpr uint32_t maxRecordSize = Capacity / 16;
+		static constexpr uint32_t maxMessageSize = Capacity / 2;
+		static_assert(maxRecordSize <= ARENA_LENGTH_MASK, "MessageArena capacity too big for record length field");
+
+		static constexpr uint32_t recordSize(uint32_t length) {
+			return (static_cast<uint32_t>(sizeof(uint32_t)) + length + ARENA_RECORD_ALIGN - 1) & ~(ARENA_RECORD_ALIGN - 1);
+		}
+
+		bool canWrite(uint32_t length) const {
+			if (length > maxMessageSize) return false;
+			const auto fragments = length / maxRecordSize + 1;
+			//Worst case, every fragment header plus padding and one wrap
+			const auto needed = length + fragments * (recordSize(0) + ARENA_RECORD_ALIGN) + maxRecordSize;
+			return hasSpace(head.load(std::memory_order_relaxed), needed);
+		}
+
+		//recordPosition receives the position to pass to skip()
+		bool write(std::string_view message, uint32_t* recordPosition = nullptr) {
+			if (message.length() > maxMessageSize) return false;
+			uint32_t curHead;
+			if (!claim(static_cast<uint32_t>(message.length()), curHead))
+				return false;
+
+			uint32_t firstPosition = 0;
+			uint32_t firstLength = 0;
+			bool firstFragment = true;
+			do {
+				const auto fragment = message.substr(0, maxRecordSize);
+				message.remove_prefix(fragment.length());
+				const auto length = static_cast<uint32_t>(fragment.length());
+				const auto size = recordSize(length);
+				const auto wrapBytes = wrapSkip(curHead, size);
+				if (wrapBytes) {
+					storeLength(curHead % Capacity, ARENA_WRAP_MARKER);
+					curHead += wrapBytes;
+				}
+				const auto offset = curHead % Capacity;
+				memcpy(data + offset + sizeof(uint32_t), fragment.data(), length);
+				const auto lengthWord = length | ARENA_FLAG_COMMITTED | (message.empty() ? 0 : ARENA_FLAG_MORE_FRAGMENTS);
+				if (firstFragment) {
+					firstPosition = curHead;
+					firstLength = lengthWord;
+				} else {
+					storeLength(offset, lengthWord);
+				}
+				firstFragment = false;
+				curHead += size;
+			} while (!message.empty());
+
+			if (recordPosition)
+				*recordPosition = firstPosition;
+			publish(firstPosition, firstLength);
+			return true;
+		}
+
+		//Zero copy writing, producer side. Claims space for one record of up to maxLength bytes and returns where the payload goes,
+		//nullptr if there is no space. Every successful reserve has to be followed by commit, the consumer waits for it
+		char* reserve(uint32_t maxLength, uint32_t& recordPosition) {
+			if (maxLength > maxRecordSize) return nullptr;
+			uint32_t curHead;
+			if (!claim(maxLength, curHead))
+				return nullptr;
+			const auto wrapBytes = wrapSkip(curHead, recordSize(maxLength));
+			if (wrapBytes)
+				storeLength(curHead % Capacity, ARENA_WRAP_MARKER);
+			recordPosition = curHead + wrapBytes;
+			return data + recordPosition % Capacity + sizeof(uint32_t);
+		}
+
+		//length can be less than what was reserved, the rest becomes a skipped padding record. skipped discards the message
+		void commit(uint32_t recordPosition, uint32_t maxLength, uint32_t length, bool skipped = false) {
+			const auto reservedSize = recordSize(maxLength);
+			const auto usedSize = recordSize(length);
+			if (usedSize < reservedSize) //Difference is a multiple of ARENA_RECORD_ALIGN, always room for a length word
+				storeLength((recordPosition + usedSize) % Capacity,
+					(reservedSize - usedSize - static_cast<uint32_t>(sizeof(uint32_t))) | ARENA_FLAG_COMMITTED | ARENA_FLAG_SKIP);
+			publish(recordPosition, length | ARENA_FLAG_COMMITTED | (skipped ? ARENA_FLAG_SKIP : 0));
+		}
+
+		//Producer side. Marks a message as replaced, returns false if the consumer already got it
+		bool skip(uint32_t recordPosition) {
+			const auto curTail = tail.load(std::memory_order_acquire);
+			const auto curHead = head.load(std::memory_order_relaxed);
+			if (recordPosition - curTail >= curHead - curTail)
+				return false; //Already consumed
+			//CAS instead of fetch_or, if the consumer just cleared the word it's consumed and may already belong to a new record
+			auto& word = lengthWord(recordPosition % Capacity);
+			auto expected = word.load(std::memory_order_acquire);
+			if (!(expected & ARENA_FLAG_COMMITTED) || expected == ARENA_WRAP_MARKER)
+				return false;
+			//Another producer may have reclaimed the space meanwhile, then expected is someone else's payload
+			if (recordPosition - tail.load(std::memory_order_acquire) >= curHead - curTail)
+				return false;
+			//Release pairs with the consumer's exchange, so the space is only reused after this write
+			return word.compare_exchange_strong(expected, expected | ARENA_FLAG_SKIP, std::memory_order_release, std::memory_order_relaxed);
+		}
+
+		//Consumer side, reassembles fragmented messages and drops skipped ones. Call it until it returns false,
+		//only then all consumed space is handed back to the producers
+		bool read(std::string& message) {
+			auto curTail = readTail.load(std::memory_order_relaxed);
+			const auto curHead = head.load(std::memory_order_acquire);
+
+			while (curTail != curHead) {
+				auto position = curTail;
+				auto length = loadLength(position % Capacity);
+				if (length == ARENA_WRAP_MARKER) {
+					position += Capacity - position % Capacity;
+					length = loadLength(0);
+				}
+				if (!(length & ARENA_FLAG_COMMITTED))
+					break; //Claimed but not written yet, everything behind it has to wait to keep the order
+				if (position != curTail)
+					clearRecord(curTail % Capacity, Capacity - curTail % Capacity); //Wrap marker and padding
+				//Take the first length word, from here on skip() fails instead of racing with us
+				length = lengthWord(position % Capacity).exchange(0, std::memory_order_acquire);
+
+				message.clear();
+				const bool skipped = (length & ARENA_FLAG_SKIP) != 0;
+				while (true) {
+					const auto payloadLength = length & ARENA_LENGTH_MASK;
+					if (!skipped)
+						message.append(data + position % Capacity + sizeof(uint32_t), payloadLength);
+					clearRecord(position % Capacity, recordSize(payloadLength)); //Length word is a no-op for the first one, already taken
+					position += recordSize(payloadLength);
+					if (!(length & ARENA_FLAG_MORE_FRAGMENTS))
+						break;
+					length = loadLength(position % Capacity);
+					if (length == ARENA_WRAP_MARKER) {
+						clearRecord(position % Capacity, Capacity - position % Capacity);
+						position += Capacity - position % Capacity;
+						length = loadLength(0);
+					}
+				}
+				curTail = position;
+
+				if (!skipped) {
+					readTail.store(curTail, std::memory_order_relaxed);
+					if (curTail - tail.load(std::memory_order_relaxed) >= Capacity / ARENA_RELEASE_FRACTION)
+						tail.store(curTail, std::memory_order_release);
+					return true;
+				}
+			}
+			readTail.store(curTail, std::memory_order_relaxed);
+			if (curTail != tail.load(std::memory_order_relaxed)) //Caught up, hand everything back
+				tail.store(curTail, std::memory_order_release);
+			return false;
+		}
+
+		//Consumer side
+		bool empty() const {
+			return readTail.load(std::memory_order_relaxed) == head.load(std::memory_order_acquire);
+		}
+
+		uint32_t usedBytes() const {
+			//Tail first, loaded the other way round it may already be past the head we saw
+			const auto curTail = tail.load(std::memory_order_acquire);
+			return head.load(std::memory_order_acquire) - curTail;
+		}
+
+	private:
+		static uint32_t freeBytes(uint32_t curHead, uint32_t curTail) {
+			return Capacity - (curHead - curTail);
+		}
+
+		bool hasSpace(uint32_t curHead, uint32_t needed) const {
+			//Acquire on both, consumer has to be done reading before we may overwrite
+			auto knownTail = cachedTail.load(std::memory_order_acquire);
+			if (freeBytes(curHead, knownTail) >= needed)
+				return true;
+			const auto curTail = tail.load(std::memory_order_acquire);
+			//Other producers may have moved it further already, only ever forward
+			while (static_cast<int32_t>(curTail - knownTail) > 0 &&
+				!cachedTail.compare_exchange_weak(knownTail, curTail, std::memory_order_release, std::memory_order_acquire)) {}
+			return freeBytes(curHead, curTail) >= needed;
+		}
+
+		static uint32_t wrapSkip(uint32_t curHead, uint32_t size) {
+			const auto contiguous = Capacity - curHead % Capacity;
+			return size > contiguous ? contiguous : 0;
+		}
+
+		//Bytes a message of length takes when written at position, including wrap padding
+		static uint32_t messageSpan(uint32_t position, uint32_t length) {
+			uint32_t span = 0;
+			do {
+				const auto fragment = length < maxRecordSize ? length : maxRecordSize;
+				const auto size = recordSize(fragment);
+				span += wrapSkip(position + span, size) + size;
+				length -= fragment;
+			} while (length);
+			return span;
+		}
+
+		bool claim(uint32_t length, uint32_t& position) {
+			auto curHead = head.load(std::memory_order_relaxed);
+			do {
+				if (!hasSpace(curHead, messageSpan(curHead, length)))
+					return false;
+			} while (!head.compare_exchange_weak(curHead, curHead + messageSpan(curHead, length), std::memory_order_relaxed));
+			position = curHead;
+			return true;
+		}
+
+		void publish(uint32_t recordPosition, uint32_t length) {
+			//Release, payload and all later fragments have to be visible before the consumer sees it committed
+			lengthWord(recordPosition % Capacity).store(length, std::memory_order_release);
+		}
+
+		//Records are ARENA_RECORD_ALIGN aligned, so the length word is a properly aligned 32bit value
+		std::atomic<uint32_t>& lengthWord(uint32_t offset) {
+			return *reinterpret_cast<std::atomic<uint32_t>*>(data + offset);
+		}
+		const std::atomic<uint32_t>& lengthWord(uint32_t offset) const {
+			return *reinterpret_cast<const std::atomic<uint32_t>*>(data + offset);
+		}
+		void storeLength(uint32_t offset, uint32_t length) {
+			lengthWord(offset).store(length, std::memory_order_relaxed);
+		}
+		//Consumer side. Producers don't touch consumed bytes until tail passes them, only the length word may still see a skip()
+		void clearRecord(uint32_t offset, uint32_t size) {
+			storeLength(offset, 0);
+			memset(data + offset + sizeof(uint32_t), 0, size - sizeof(uint32_t));
+		}
+		uint32_t loadLength(uint32_t offset) const {
+			return lengthWord(offset).load(std::memory_order_acquire);
+		}
+
+		alignas(64) std::atomic<uint32_t> head{ 0 }; //Claimed by the game's producers
+		mutable std::atomic<uint32_t> cachedTail{ 0 }; //Last tail a producer saw, on the producers' line
+		alignas(64) std::atomic<uint32_t> tail{ 0 }; //Only written by TeamSpeak, what the producers may reuse
+		std::atomic<uint32_t> readTail{ 0 }; //Consumer only, how far it actually read
+		alignas(64) char data[Capacity];
+	};
+}
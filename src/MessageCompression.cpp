@@ -0,0 +1,127 @@
+#include "MessageCompression.hpp"
+#include <cstdint>
+#include <cstring>
+
+static constexpr uint32_t hashBits = 12;
+static constexpr size_t lastLiterals = 5; //Matches stop a bit before the end so finding one never reads past it
+
+static uint32_t read32(const char* data) {
+	uint32_t value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+static uint32_t hashSequence(uint32_t sequence) {
+	return (sequence * 2654435761u) >> (32 - hashBits);
+}
+
+static bool writeLength(size_t length, char*& out, const char* outEnd) {
+	for (; length >= 255; length -= 255) {
+		if (out == outEnd) return false;
+		*out++ = static_cast<char>(255);
+	}
+	if (out == outEnd) return false;
+	*out++ = static_cast<char>(length);
+	return true;
+}
+
+static bool writeSequence(const char* literals, size_t literalLength, size_t offset, size_t matchLength, char*& out, const char* outEnd) {
+	if (out == outEnd) return false;
+	char* token = out++;
+	*token = static_cast<char>((literalLength < 15 ? literalLength : 15) << 4);
+	if (literalLength >= 15 && !writeLength(literalLength - 15, out, outEnd))
+		return false;
+	if (static_cast<size_t>(outEnd - out) < literalLength) return false;
+	memcpy(out, literals, literalLength);
+	out += literalLength;
+	if (matchLength == 0) return true; //Last sequence
+
+	if (outEnd - out < 2) return false;
+	*out++ = static_cast<char>(offset & 0xFF);
+	*out++ = static_cast<char>(offset >> 8);
+	const auto extraMatch = matchLength - SHAREDMEM_LZ_MIN_MATCH;
+	*token |= static_cast<char>(extraMatch < 15 ? extraMatch : 15);
+	return extraMatch < 15 || writeLength(extraMatch - 15, out, outEnd);
+}
+
+size_t SharedMemoryHandlerInternal::compressMessage(std::string_view input, char* output, size_t outputCapacity) {
+	const char* in = input.data();
+	const size_t length = input.length();
+	char* out = output;
+	const char* outEnd = output + outputCapacity;
+
+	uint32_t table[1 << hashBits] = {}; //Last position per hash, verified before use so stale entries don't matter
+	size_t anchor = 0;
+	size_t position = 1;
+	if (length > lastLiterals + SHAREDMEM_LZ_MIN_MATCH) {
+		const size_t matchLimit = length - lastLiterals;
+		while (position + SHAREDMEM_LZ_MIN_MATCH <= matchLimit) {
+			const auto sequence = read32(in + position);
+			auto& slot = table[hashSequence(sequence)];
+			const size_t candidate = slot;
+			slot = static_cast<uint32_t>(position);
+			if (candidate >= position || position - candidate > SHAREDMEM_LZ_MAX_OFFSET || read32(in + candidate) != sequence) {
+				++position;
+				continue;
+			}
+
+			size_t matchLength = SHAREDMEM_LZ_MIN_MATCH;
+			while (position + matchLength < matchLimit && in[candidate + matchLength] == in[position + matchLength])
+				++matchLength;
+			if (!writeSequence(in + anchor, position - anchor, position - candidate, matchLength, out, outEnd))
+				return 0;
+			position += matchLength;
+			anchor = position;
+		}
+	}
+	if (!writeSequence(in + anchor, length - anchor, 0, 0, out, outEnd))
+		return 0;
+	return static_cast<size_t>(out - output);
+}
+
+static bool readLength(const unsigned char*& in, const unsigned char* inEnd, size_t& length) {
+	unsigned char byte;
+	do {
+		if (in == inEnd) return false;
+		byte = *in++;
+		length += byte;
+	} while (byte == 255);
+	return true;
+}
+
+bool SharedMemoryHandlerInternal::decompressMessage(std::string_view input, size_t originalLength, std::string& output) {
+	auto in = reinterpret_cast<const unsigned char*>(input.data());
+	const auto inEnd = in + input.length();
+	output.resize(originalLength);
+	char* out = output.data();
+	const char* outEnd = out + originalLength;
+
+	while (in != inEnd) {
+		const auto token = *in++;
+		size_t literalLength = token >> 4;
+		if (literalLength == 15 && !readLength(in, inEnd, literalLength))
+			return false;
+		if (static_cast<size_t>(inEnd - in) < literalLength || static_cast<size_t>(outEnd - out) < literalLength)
+			return false;
+		memcpy(out, in, literalLength);
+		in += literalLength;
+		out += literalLength;
+		if (in == inEnd) break; //Last sequence
+
+		if (inEnd - in < 2) return false;
+		const size_t offset = in[0] | (in[1] << 8);
+		in += 2;
+		size_t matchLength = token & 15;
+		if (matchLength == 15 && !readLength(in, inEnd, matchLength))
+			return false;
+		matchLength += SHAREDMEM_LZ_MIN_MATCH;
+		if (offset == 0 || offset > static_cast<size_t>(out - output.data()) || static_cast<size_t>(outEnd - out) < matchLength)
+			return false;
+		//Byte by byte, the match may overlap what it produces
+		const char* match = out - offset;
+		for (size_t i = 0; i < matchLength; ++i)
+			out[i] = match[i];
+		out += matchLength;
+	}
+	return out == outEnd;
+}
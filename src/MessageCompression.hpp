@@ -0,0 +1,25 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+/*
+Byte oriented LZ77 for async messages, the same sequence layout as an LZ4 block.
+A sequence is [token][extra literal length][literals][offset uint16 little endian][extra match length].
+High nibble of the token is the literal count, low nibble the match length minus SHAREDMEM_LZ_MIN_MATCH,
+15 means the length continues in extra bytes that are added up until one is smaller than 255.
+The last sequence only has literals, it ends at the end of the input.
+
+SPEAKERS and other text frames repeat netIDs, frequencies, unit names and vehicle IDs all the time,
+that's what the matches pick up. No entropy coding, decompressing is a few memcpy per sequence.
+*/
+
+#define SHAREDMEM_LZ_MIN_MATCH 4
+#define SHAREDMEM_LZ_MAX_OFFSET 65535
+
+namespace SharedMemoryHandlerInternal {
+	//Returns compressed length, 0 if it doesn't fit outputCapacity. Never reads or writes out of bounds
+	size_t compressMessage(std::string_view input, char* output, size_t outputCapacity);
+	//false if the data is corrupt or doesn't decompress to exactly originalLength bytes
+	bool decompressMessage(std::string_view input, size_t originalLength, std::string& output);
+}
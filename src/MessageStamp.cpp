@@ -0,0 +1,51 @@
+#include "MessageStamp.hpp"
+#include <charconv>
+#include <cstring>
+#include "Transport.hpp"
+
+using namespace SharedMemoryHandlerInternal;
+
+static constexpr char hexDigits[] = "0123456789abcdef";
+
+static void writeHex(uint64_t value, char* output) {
+	for (int digit = 15; digit >= 0; --digit, value >>= 4)
+		output[digit] = hexDigits[value & 0xF];
+}
+
+uint64_t SharedMemoryHandlerInternal::stampClock(std::chrono::steady_clock::time_point time) {
+	return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(time.time_since_epoch()).count());
+}
+
+uint64_t SharedMemoryHandlerInternal::stampClockNow() {
+	return stampClock(std::chrono::steady_clock::now());
+}
+
+MessageStamp SharedMemoryHandlerInternal::makeMessageStamp(MessageLane lane, std::chrono::steady_clock::time_point captureTime) {
+	const auto now = stampClockNow();
+	const auto capture = captureTime == std::chrono::steady_clock::time_point() ? now : stampClock(captureTime);
+	return { lane, capture < now ? capture : now, now };
+}
+
+void SharedMemoryHandlerInternal::writeMessageStamp(const MessageStamp& stamp, char* output) {
+	memcpy(output, "TS\t", 3);
+	output[3] = static_cast<char>('0' + static_cast<uint8_t>(stamp.lane));
+	output[4] = '\t';
+	writeHex(stamp.captureTime, output + 5);
+	output[21] = '\t';
+	writeHex(stamp.enqueueTime, output + 22);
+	output[38] = '\t';
+}
+
+bool SharedMemoryHandlerInternal::readMessageStamp(std::string_view& message, MessageStamp& stamp) {
+	if (message.length() < MESSAGE_STAMP_LENGTH || message.substr(0, 3) != std::string_view("TS\t", 3) ||
+		message[4] != '\t' || message[21] != '\t' || message[38] != '\t')
+		return false;
+	const auto lane = static_cast<uint8_t>(message[3] - '0');
+	if (lane >= MESSAGE_LANE_COUNT ||
+		std::from_chars(message.data() + 5, message.data() + 21, stamp.captureTime, 16).ptr != message.data() + 21 ||
+		std::from_chars(message.data() + 22, message.data() + 38, stamp.enqueueTime, 16).ptr != message.data() + 38)
+		return false;
+	stamp.lane = static_cast<MessageLane>(lane);
+	message.remove_prefix(MESSAGE_STAMP_LENGTH);
+	return true;
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+/*
+"TS\t<lane>\t<capture>\t<enqueue>\t<message>", only sent if TransportCapability::MessageTimestamps is negotiated.
+lane is one digit, the MessageLane the message was sent in. capture and enqueue are 16 hex digits of steady_clock microseconds,
+capture is when the data in the message was sampled, enqueue when it was handed to the transport. Fixed width, so the zero
+copy writer can reserve it up front.
+The stamp wraps everything else in the record, "REQ" and keyed messages included. Only "CMP" goes around it, TeamSpeak
+decompresses, strips the stamp and handles the rest like any other record.
+steady_clock is QueryPerformanceCounter on Windows and CLOCK_MONOTONIC elsewhere, both are the same in every process of a machine.
+*/
+
+#define MESSAGE_STAMP_LENGTH 39
+
+enum class MessageLane : uint8_t;
+
+namespace SharedMemoryHandlerInternal {
+	struct MessageStamp {
+		MessageLane lane;
+		uint64_t captureTime; //steady_clock microseconds
+		uint64_t enqueueTime;
+	};
+
+	uint64_t stampClock(std::chrono::steady_clock::time_point time);
+	uint64_t stampClockNow();
+	//Enqueue time is now, captureTime defaults to it
+	MessageStamp makeMessageStamp(MessageLane lane, std::chrono::steady_clock::time_point captureTime = {});
+	//Writes exactly MESSAGE_STAMP_LENGTH bytes
+	void writeMessageStamp(const MessageStamp& stamp, char* output);
+	//Consumer side. Removes the stamp from message, false if there is none
+	bool readMessageStamp(std::string_view& message, MessageStamp& stamp);
+}
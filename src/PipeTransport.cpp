@@ -0,0 +1,489 @@
+#include "PipeTransport.hpp"
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <cstring>
+using namespace SharedMemoryHandlerInternal;
+using namespace std::string_view_literals;
+
+void SharedMemoryHandlerInternal::appendPipeFrame(std::vector<char>& buffer, PipeFrameKind kind, uint32_t sequence, std::string_view payload) {
+	PipeFrameHeader header{ static_cast<uint32_t>(payload.length()), kind, {}, sequence };
+	const auto position = buffer.size();
+	buffer.resize(position + sizeof(header) + payload.length());
+	memcpy(buffer.data() + position, &header, sizeof(header));
+	memcpy(buffer.data() + position + sizeof(header), payload.data(), payload.length());
+}
+
+char* SharedMemoryHandlerInternal::PipeFrameReader::prepare(size_t& space) {
+	constexpr size_t minSpace = 64 * 1024;
+	if (begin == end) {
+		begin = end = 0;
+	} else if (begin > buffer.size() / 2) {
+		memmove(buffer.data(), buffer.data() + begin, end - begin);
+		end -= begin;
+		begin = 0;
+	}
+	size_t needed = minSpace;
+	if (end - begin >= sizeof(PipeFrameHeader)) { //Make room for all of the incomplete frame
+		uint32_t length;
+		memcpy(&length, buffer.data() + begin, sizeof(length));
+		if (length <= PIPE_MAX_FRAME_SIZE)
+			needed = (std::max)(needed, sizeof(PipeFrameHeader) + length - (end - begin));
+	}
+	if (buffer.size() - end < needed)
+		buffer.resize(end + needed);
+	space = buffer.size() - end;
+	return buffer.data() + end;
+}
+
+bool SharedMemoryHandlerInternal::PipeFrameReader::next(PipeFrameHeader& header, std::string_view& payload) {
+	if (corrupt || end - begin < sizeof(PipeFrameHeader)) return false;
+	memcpy(&header, buffer.data() + begin, sizeof(header));
+	if (header.length > PIPE_MAX_FRAME_SIZE) {
+		corrupt = true;
+		return false;
+	}
+	if (end - begin < sizeof(header) + header.length) return false;
+	payload = std::string_view(buffer.data() + begin + sizeof(header), header.length);
+	begin += sizeof(header) + header.length;
+	return true;
+}
+
+PipeTransport::PipeTransport(std::string _path) : path(std::move(_path)) {
+	isReady();
+}
+
+PipeTransport::~PipeTransport() {
+	shutdown();
+	std::unique_lock lock(connectionLock);
+	std::scoped_lock streamLock(writeLock, readLock);
+	disconnect();
+}
+
+bool PipeTransport::isReady() {
+	if (connected.load(std::memory_order_acquire) && !connectionLost.load(std::memory_order_relaxed)) return true;
+
+	std::unique_lock lock(connectionLock);
+	std::scoped_lock streamLock(writeLock, readLock);
+	if (connectionLost)
+		disconnect();
+	if (connected) return true; //Someone else connected while we waited for the lock
+
+	const auto now = std::chrono::steady_clock::now();
+	if (now < nextConnectAttempt) return false;
+	if (!connectToConsumer()) {
+		nextConnectAttempt = now + reconnectBackoff;
+		reconnectBackoff = (std::min)(reconnectBackoff * 2, maxReconnectBackoff);
+		return false;
+	}
+	errorMessage.clear();
+	reconnectBackoff = minReconnectBackoff;
+	if (hadSession) //First connect, nothing to resend
+		sessionChanged = true;
+	hadSession = true;
+	return true;
+}
+
+bool PipeTransport::connectToConsumer() {
+	if (!openPipe())
+		return false;
+	const uint32_t capabilities = PIPE_PRODUCER_CAPABILITIES;
+	queueFrame(PipeFrameKind::Hello, 0, std::string_view(reinterpret_cast<const char*>(&capabilities), sizeof(capabilities)));
+	flushSendBuffer();
+
+	//Capabilities have to be known before the first message goes out
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(PIPE_TIMEOUT);
+	while (!helloReceived && !connectionLost && std::chrono::steady_clock::now() < deadline) {
+		receiveFrames();
+		if (!helloReceived)
+			waitReadable(10ms);
+	}
+	if (!helloReceived) {
+		errorMessage = "TFAR ERR No answer from TeamSpeak on the pipe";
+		disconnect();
+		return false;
+	}
+	connected.store(true, std::memory_order_release);
+	return true;
+}
+
+void PipeTransport::disconnect() {
+	closePipe();
+	connected = false;
+	connectionLost = false;
+	sendBuffer.clear();
+	sendBufferHead = 0;
+	sendBufferOffset = 0;
+	queuedBytes = 0;
+	keyedFrameOffsets.clear(); //Parked messages are the newest state, they go to the next session
+	reader.clear();
+	readCompletions.clear();
+	helloReceived = false;
+	syncAnswered = false;
+	negotiatedCapabilities = 0;
+	configNeedsRefresh = false;
+}
+
+bool PipeTransport::canDoAsyncRequest(MessageLane) const {
+	if (!connected) return false;
+	//Callers don't tell us the size upfront, check for a typical big message
+	if (queuedBytes.load(std::memory_order_relaxed) + 2048 <= PIPE_SEND_BUFFER_SIZE)
+		return true;
+	telemetry.asyncRejected.fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+
+bool PipeTransport::queueFrame(PipeFrameKind kind, uint32_t sequence, std::string_view payload, uint64_t* streamOffset) {
+	if (payload.length() > PIPE_MAX_FRAME_SIZE) return false;
+	const auto queued = sendBuffer.size() - sendBufferHead;
+	if (queued > 0 && queued + sizeof(PipeFrameHeader) + payload.length() > PIPE_SEND_BUFFER_SIZE) {
+		flushSendBuffer();
+		const auto stillQueued = sendBuffer.size() - sendBufferHead;
+		if (stillQueued > 0 && stillQueued + sizeof(PipeFrameHeader) + payload.length() > PIPE_SEND_BUFFER_SIZE)
+			return false; //TeamSpeak doesn't keep up
+	}
+	if (streamOffset)
+		*streamOffset = sendBufferOffset + sendBuffer.size();
+	appendPipeFrame(sendBuffer, kind, sequence, payload);
+	queuedBytes.store(static_cast<uint32_t>(sendBuffer.size() - sendBufferHead), std::memory_order_relaxed);
+	return true;
+}
+
+bool PipeTransport::queueAsync(std::string_view request, const MessageStamp& stamp, uint64_t* streamOffset) {
+	const auto message = compressAsyncRequest(stampAsyncRequest(request, stamp), &telemetry);
+	if (!queueFrame(PipeFrameKind::Async, 0, message, streamOffset))
+		return false;
+	telemetry.countAsyncEnqueued(static_cast<uint32_t>(message.length()), queuedBytes.load(std::memory_order_relaxed), stamp.lane);
+	return true;
+}
+
+void PipeTransport::flushSendBuffer() {
+	while (sendBufferHead < sendBuffer.size()) {
+		size_t written;
+		if (!writeSome(sendBuffer.data() + sendBufferHead, sendBuffer.size() - sendBufferHead, written)) {
+			connectionLost = true;
+			return;
+		}
+		if (written == 0) break; //Pipe is full, pollCompletions or the next message retries
+		sendBufferHead += written;
+	}
+	if (sendBufferHead == sendBuffer.size() || sendBufferHead > sendBuffer.size() / 2) {
+		sendBuffer.erase(sendBuffer.begin(), sendBuffer.begin() + sendBufferHead);
+		sendBufferOffset += sendBufferHead;
+		sendBufferHead = 0;
+	}
+	queuedBytes.store(static_cast<uint32_t>(sendBuffer.size() - sendBufferHead), std::memory_order_relaxed);
+}
+
+void PipeTransport::receiveFrames() {
+	while (true) {
+		PipeFrameHeader header;
+		std::string_view payload;
+		while (reader.next(header, payload)) {
+			switch (header.kind) {
+				case PipeFrameKind::Hello: {
+					uint32_t consumerCapabilities = 0;
+					memcpy(&consumerCapabilities, payload.data(), (std::min)(payload.length(), sizeof(consumerCapabilities)));
+					negotiatedCapabilities = consumerCapabilities & PIPE_PRODUCER_CAPABILITIES;
+					helloReceived = true;
+					break;
+				}
+				case PipeFrameKind::SyncAnswer:
+					if (header.sequence == awaitedSyncSequence && !syncAnswered) { //Otherwise the request already timed out
+						syncAnswer.assign(payload);
+						syncAnswered = true;
+					}
+					break;
+				case PipeFrameKind::Completion: {
+					const auto separator = payload.find('\t');
+					uint32_t requestID = 0;
+					if (separator == std::string_view::npos ||
+						std::from_chars(payload.data(), payload.data() + separator, requestID).ec != std::errc())
+						break; //Malformed, drop
+					readCompletions.emplace_back(requestID, std::string(payload.substr(separator + 1)));
+					break;
+				}
+				case PipeFrameKind::ConfigRefresh:
+					configNeedsRefresh = !payload.empty() && payload[0] != 0;
+					break;
+				case PipeFrameKind::Consumed:
+					for (size_t offset = 0; offset + sizeof(PipeConsumedRecord) <= payload.length(); offset += sizeof(PipeConsumedRecord)) {
+						PipeConsumedRecord record;
+						memcpy(&record, payload.data() + offset, sizeof(record));
+						if (record.lane < MESSAGE_LANE_COUNT)
+							consumerTelemetry.countConsumed({ static_cast<MessageLane>(record.lane), record.captureTime, record.enqueueTime }, record.consumeTime);
+					}
+					break;
+				default: //Newer TeamSpeak plugin
+					break;
+			}
+		}
+		if (reader.isCorrupt()) {
+			connectionLost = true;
+			return;
+		}
+
+		size_t space;
+		char* target = reader.prepare(space);
+		size_t read;
+		if (!readSome(target, space, read)) {
+			connectionLost = true;
+			return;
+		}
+		if (read == 0) return;
+		reader.commit(read);
+	}
+}
+
+bool PipeTransport::doSyncRequest(std::string_view request, std::string& answer) {
+	if (!isReady()) return false;
+	if (getCapture().isActive())
+		getCapture().record(CaptureRecordKind::Sync, request);
+	std::unique_lock lock(syncLock);
+	if (!sendSyncRequest(request))
+		return false;
+	answer.assign(syncAnswer);
+	return true;
+}
+
+bool PipeTransport::doSyncRequest(std::string_view request, char* output, size_t outputSize) {
+	if (!isReady()) return false;
+	if (getCapture().isActive())
+		getCapture().record(CaptureRecordKind::Sync, request);
+	std::unique_lock lock(syncLock);
+	if (!sendSyncRequest(request))
+		return false;
+	if (outputSize > 0) {
+		const auto copied = (std::min)(syncAnswer.length(), outputSize - 1);
+		memcpy(output, syncAnswer.data(), copied);
+		output[copied] = 0;
+	}
+	return true;
+}
+
+bool PipeTransport::sendSyncRequest(std::string_view request) {
+	const auto sequence = ++syncSequence;
+	{
+		std::unique_lock lock(readLock);
+		awaitedSyncSequence = sequence;
+		syncAnswered = false;
+	}
+	const auto start = std::chrono::steady_clock::now();
+	{
+		std::unique_lock lock(writeLock);
+		if (!queueFrame(PipeFrameKind::Sync, sequence, request))
+			return false;
+		flushSendBuffer();
+	}
+
+	const auto deadline = start + std::chrono::milliseconds(PIPE_TIMEOUT);
+	while (true) {
+		{
+			std::unique_lock lock(readLock);
+			receiveFrames();
+			if (syncAnswered) break;
+		}
+		const auto now = std::chrono::steady_clock::now();
+		if (now >= deadline || connectionLost) {
+			telemetry.syncTimeouts.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		{
+			std::unique_lock lock(writeLock);
+			flushSendBuffer(); //The request may still wait behind a full pipe
+		}
+		waitReadable((std::min)(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now) + 1ms, 10ms));
+	}
+	telemetry.countSyncLatency(std::chrono::steady_clock::now() - start);
+	return true;
+}
+
+bool PipeTransport::doAsyncRequest(std::string_view request, MessageLane lane, std::chrono::steady_clock::time_point captureTime) {
+	if (!isReady()) return false;
+	if (getCapture().isActive())
+		getCapture().record(CaptureRecordKind::Async, request, {}, lane);
+	return sendAsync(request, nullptr, makeMessageStamp(lane, captureTime));
+}
+
+bool PipeTransport::doAsyncRequest(std::string_view request, const std::string& key, MessageLane lane, std::chrono::steady_clock::time_point captureTime) {
+	if (!isReady()) return false;
+	if (getCapture().isActive())
+		getCapture().record(CaptureRecordKind::Async, request, key, lane);
+	return sendAsync(request, &key, makeMessageStamp(lane, captureTime));
+}
+
+bool PipeTransport::sendAsync(std::string_view request, const std::string* key, const MessageStamp& stamp) {
+	std::unique_lock lock(writeLock);
+	if (hasParkedMessages)
+		flushParkedMessages();
+	bool queued = true;
+	if (!key) {
+		queued = queueAsync(request, stamp);
+		if (!queued)
+			telemetry.countAsyncDropped(stamp.lane);
+	} else if (!addKeyedRequest(request, *key, stamp)) {
+		auto [parked, inserted] = parkedKeyedMessages.try_emplace(*key, ParkedMessage{ std::string(request), stamp });
+		if (!inserted) { //Replaces older parked one, that one never reaches TeamSpeak
+			parked->second = ParkedMessage{ std::string(request), stamp };
+			telemetry.countAsyncDropped(stamp.lane);
+		}
+		hasParkedMessages = true;
+	}
+	//Right away, like a message in the arena is visible right away. Costs a syscall per message
+	flushSendBuffer();
+	return queued;
+}
+
+bool PipeTransport::addKeyedRequest(std::string_view request, const std::string& key, const MessageStamp& stamp) {
+	uint64_t offset;
+	if (!queueAsync(request, stamp, &offset))
+		return false;
+	parkedKeyedMessages.erase(key); //We just sent a newer one
+	auto [found, inserted] = keyedFrameOffsets.try_emplace(key, offset);
+	if (!inserted) {
+		//Still in our buffer, TeamSpeak would only throw it away. Too late once the OS has any of it
+		if (found->second >= sendBufferOffset + sendBufferHead)
+			sendBuffer[found->second - sendBufferOffset + offsetof(PipeFrameHeader, kind)] = static_cast<char>(PipeFrameKind::Skipped);
+		found->second = offset;
+	}
+	return true;
+}
+
+void PipeTransport::flushParkedMessages() {
+	for (auto it = parkedKeyedMessages.begin(); it != parkedKeyedMessages.end();) {
+		auto key = it->first;
+		auto message = std::move(it->second);
+		it = parkedKeyedMessages.erase(it);
+		if (!addKeyedRequest(message.message, key, message.stamp)) {
+			parkedKeyedMessages.emplace(std::move(key), std::move(message));
+			return; //Still full
+		}
+	}
+	hasParkedMessages = false;
+}
+
+Transport::AsyncWriter PipeTransport::reserveAsyncRequest(uint32_t maxLength, MessageLane lane, std::chrono::steady_clock::time_point captureTime) {
+	AsyncWriter writer;
+	if (!isReady()) return writer;
+	writer.lane = lane;
+	writer.captureTime = captureTime;
+	writer.ownedBuffer.reset(new char[maxLength]); //Not zeroed, only what is written gets sent
+	writer.buffer = writer.ownedBuffer.get();
+	writer.transport = this;
+	writer.capacity = maxLength;
+	return writer;
+}
+
+bool PipeTransport::commitAsyncWriter(AsyncWriter& writer, const std::string* key) {
+	if (getCapture().isActive())
+		getCapture().record(CaptureRecordKind::Async, writer.view(), key ? std::string_view(*key) : std::string_view(), writer.lane);
+	return sendAsync(writer.view(), key, makeMessageStamp(writer.lane, writer.captureTime));
+}
+
+void PipeTransport::cancelAsyncWriter(AsyncWriter&) {
+	//Nothing was queued yet, the writer frees its buffer
+}
+
+bool PipeTransport::doSyncAndAsyncRequest(std::string_view syncRequest, std::string& answer, std::string_view asyncRequest) {
+	//One stream, the async message is always ahead of the sync one
+	doAsyncRequest(asyncRequest);
+	return doSyncRequest(syncRequest, answer);
+}
+
+uint32_t PipeTransport::doPipelinedRequest(std::string_view request, RequestCallback callback, MessageLane lane,
+	std::chrono::steady_clock::time_point captureTime) {
+	if (!isReady()) return 0;
+	if (!isCapabilityActive(TransportCapability::PipelinedRequests)) return 0; //TeamSpeak would take it for a normal message
+	if (getCapture().isActive())
+		getCapture().record(CaptureRecordKind::Pipelined, request, {}, lane);
+
+	std::unique_lock pendingLock(pendingRequestsLock);
+	if (pendingRequests.size() >= SHAREDMEM_MAX_PIPELINED_REQUESTS)
+		return 0;
+	const auto requestID = takeRequestID();
+
+	thread_local std::string record; //Keeps its capacity
+	char id[16];
+	record.assign("REQ\t"sv);
+	record.append(id, std::to_chars(id, id + sizeof(id), requestID).ptr);
+	record += '\t';
+	record.append(request);
+	{
+		std::unique_lock lock(writeLock);
+		const bool queued = queueAsync(record, makeMessageStamp(lane, captureTime)); //Stamp goes around the "REQ"
+		flushSendBuffer();
+		if (!queued) {
+			telemetry.countAsyncDropped(lane);
+			return 0;
+		}
+	}
+	telemetry.pipelinedRequests.fetch_add(1, std::memory_order_relaxed);
+	pendingRequests.emplace(requestID, PendingRequest{ std::move(callback), std::chrono::steady_clock::now(), false });
+	return requestID;
+}
+
+void PipeTransport::pollCompletions() {
+	if (!isReady()) return;
+	if (sessionChanged.exchange(false)) {
+		failPendingRequests();
+		onNewSession();
+	}
+	{
+		std::unique_lock lock(writeLock);
+		if (hasParkedMessages)
+			flushParkedMessages();
+		flushSendBuffer();
+	}
+	std::unique_lock pendingLock(pendingRequestsLock);
+	{
+		std::unique_lock lock(readLock);
+		receiveFrames();
+		for (auto& completion : readCompletions)
+			receivedCompletions.emplace_back(std::move(completion));
+		readCompletions.clear();
+	}
+	dispatchCompletions(pendingLock, &telemetry);
+}
+
+bool PipeTransport::isConnected() {
+	return isReady(); //An open stream means TeamSpeak is there
+}
+
+bool PipeTransport::needsConfigRefresh() {
+	if (!isReady()) return false;
+	std::unique_lock lock(readLock, std::try_to_lock);
+	if (lock.owns_lock())
+		receiveFrames();
+	return configNeedsRefresh;
+}
+
+bool PipeTransport::isCapabilityActive(TransportCapability cap) {
+	//Not through isReady, queueAsync gets here with writeLock held and a lost connection would disconnect under it.
+	//Every entry point connects before it sends anything
+	if (!connected.load(std::memory_order_acquire)) return false;
+	return (negotiatedCapabilities.load(std::memory_order_relaxed) & static_cast<uint32_t>(cap)) != 0;
+}
+
+uint32_t PipeTransport::getNegotiatedCapabilities() {
+	if (!isReady()) return 0;
+	return negotiatedCapabilities.load(std::memory_order_relaxed);
+}
+
+bool PipeTransport::getTelemetry(TransportTelemetry& copy) {
+	if (!isReady()) return false;
+	telemetry.copyTo(copy);
+	return true;
+}
+
+bool PipeTransport::getConsumerTelemetry(ConsumerTelemetry& copy) {
+	if (!isReady()) return false;
+	consumerTelemetry.copyTo(copy);
+	return true;
+}
+
+void PipeTransport::shutdown() {
+	if (!connected) return;
+	std::unique_lock lock(writeLock);
+	queueFrame(PipeFrameKind::Shutdown, 0, {});
+	flushSendBuffer();
+}
@@ -0,0 +1,193 @@
+#pragma once
+#ifdef _WIN32
+#include <Windows.h>
+#endif
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "Transport.hpp"
+
+/*
+Pipe stream layout, both directions: frames of [PipeFrameHeader][payload], integers little endian.
+On Windows it's the named pipe PIPE_NAME, elsewhere the Unix domain socket PIPE_POSIX_PATH. TeamSpeak is the server.
+
+The game sends Hello with its producer capabilities right after connecting, TeamSpeak answers with Hello carrying its
+consumer capabilities. Both use the intersection from then on, like negotiatedCapabilities in shared memory.
+Async frames carry exactly what an async arena record would, a plain message, "REQ\t<id>\t<request>" or "CMP\t...".
+"REQ" is answered with a Completion frame "<id>\t<answer>", like in the completion arena.
+Sync frames have no size limit, their answer echoes the sequence so a late answer to a timed out request is never taken
+for the next one. A keyed message that is replaced while it still waits in the game's send buffer becomes a Skipped frame.
+With TransportCapability::MessageTimestamps TeamSpeak strips the "TS" stamp of Async frames and sends the stamps back with
+its consume time in Consumed frames, batched, the game adds them to its ConsumerTelemetry.
+Every connection is a new session, after reconnecting the game resends full state.
+It's one ordered stream, MessageLane is only counted in telemetry. Unlike the shared memory lanes a full pipe holds back
+every lane, there is no separate capacity per lane.
+*/
+
+#define PIPE_SEND_BUFFER_SIZE (256 * 1024) //Like the async arena, what doesn't fit is dropped or parked
+#define PIPE_MAX_FRAME_SIZE (16 * 1024 * 1024) //Anything bigger means the stream is out of sync
+
+//Everything but SyncResponseSequence, that is about the shared memory sync slot
+constexpr uint32_t PIPE_PRODUCER_CAPABILITIES =
+	static_cast<uint32_t>(TransportCapability::BinaryPositions) |
+	static_cast<uint32_t>(TransportCapability::PositionDeltas) |
+	static_cast<uint32_t>(TransportCapability::PipelinedRequests) |
+	static_cast<uint32_t>(TransportCapability::CompressedMessages) |
+	static_cast<uint32_t>(TransportCapability::MessageTimestamps) |
+	static_cast<uint32_t>(TransportCapability::PositionBatches);
+
+namespace SharedMemoryHandlerInternal {
+	enum class PipeFrameKind : uint8_t {
+		Hello, //uint32 capabilities
+		Async,
+		Skipped, //Replaced keyed message, ignore
+		Sync,
+		SyncAnswer,
+		Completion,
+		ConfigRefresh, //TeamSpeak to game, uint8 1 if the config needs to be resent
+		Shutdown, //Game to TeamSpeak, mission ended
+		Consumed //TeamSpeak to game, PipeConsumedRecord for every stamped message it handled
+	};
+
+	struct PipeFrameHeader {
+		uint32_t length; //Of the payload
+		PipeFrameKind kind;
+		uint8_t reserved[3];
+		uint32_t sequence; //Sync and SyncAnswer, 0 otherwise
+	};
+	static_assert(sizeof(PipeFrameHeader) == 12, "PipeFrameHeader is part of the wire format");
+
+	struct PipeConsumedRecord {
+		uint8_t lane; //MessageLane of the stamp
+		uint8_t reserved[7];
+		uint64_t captureTime; //From the stamp, steady_clock microseconds
+		uint64_t enqueueTime;
+		uint64_t consumeTime;
+	};
+	static_assert(sizeof(PipeConsumedRecord) == 32, "PipeConsumedRecord is part of the wire format");
+
+	void appendPipeFrame(std::vector<char>& buffer, PipeFrameKind kind, uint32_t sequence, std::string_view payload);
+
+	//Collects bytes read from the stream into whole frames
+	class PipeFrameReader {
+	public:
+		//Where to read into next, space is at least what the frame that is currently incomplete still needs
+		char* prepare(size_t& space);
+		void commit(size_t read) { end += read; }
+		//payload points into the reader, valid until the next prepare. false if no whole frame is there yet
+		bool next(PipeFrameHeader& header, std::string_view& payload);
+		bool isCorrupt() const { return corrupt; }
+		void clear() { begin = end = 0; corrupt = false; }
+	private:
+		std::vector<char> buffer;
+		size_t begin = 0;
+		size_t end = 0;
+		bool corrupt = false;
+	};
+}
+
+class PipeTransport : public Transport {
+public:
+	explicit PipeTransport(std::string path = {}); //Empty for PIPE_NAME or PIPE_POSIX_PATH
+	~PipeTransport() override;
+	PipeTransport(const PipeTransport&) = delete;
+	PipeTransport& operator=(const PipeTransport&) = delete;
+
+	bool canDoAsyncRequest(MessageLane lane = MessageLane::Bulk) const override;
+	bool doSyncRequest(std::string_view request, std::string& answer) override;
+	bool doSyncRequest(std::string_view request, char* output, size_t outputSize) override;
+	bool doAsyncRequest(std::string_view request, MessageLane lane = MessageLane::Bulk, std::chrono::steady_clock::time_point captureTime = {}) override;
+	bool doAsyncRequest(std::string_view request, const std::string& key, MessageLane lane = MessageLane::Bulk,
+		std::chrono::steady_clock::time_point captureTime = {}) override;
+	//The writer formats into its own buffer, commit copies it into the send buffer
+	AsyncWriter reserveAsyncRequest(uint32_t maxLength, MessageLane lane = MessageLane::Bulk, std::chrono::steady_clock::time_point captureTime = {}) override;
+	bool doSyncAndAsyncRequest(std::string_view syncRequest, std::string& answer, std::string_view asyncRequest) override;
+	using Transport::doPipelinedRequest;
+	uint32_t doPipelinedRequest(std::string_view request, RequestCallback callback, MessageLane lane = MessageLane::Realtime,
+		std::chrono::steady_clock::time_point captureTime = {}) override;
+	//Also pushes out what a full pipe held back
+	void pollCompletions() override;
+	bool isConnected() override;
+	bool needsConfigRefresh() override;
+	bool isCapabilityActive(TransportCapability cap) override; //Doesn't connect, false until the handshake is done
+	uint32_t getNegotiatedCapabilities() override;
+	bool getTelemetry(SharedMemoryHandlerInternal::TransportTelemetry& copy) override;
+	bool getConsumerTelemetry(SharedMemoryHandlerInternal::ConsumerTelemetry& copy) override; //From Consumed frames
+	bool isReady() override; //After a failed attempt it waits reconnectBackoff before trying again
+	void shutdown() override;
+protected:
+	bool commitAsyncWriter(AsyncWriter& writer, const std::string* key) override;
+	void cancelAsyncWriter(AsyncWriter& writer) override;
+private:
+	bool connectToConsumer(); //Needs connectionLock, writeLock and readLock
+	void disconnect(); //Needs connectionLock, writeLock and readLock
+	struct ParkedMessage {
+		std::string message;
+		SharedMemoryHandlerInternal::MessageStamp stamp; //Lane and times it was sent with
+	};
+	bool sendAsync(std::string_view request, const std::string* key, const SharedMemoryHandlerInternal::MessageStamp& stamp);
+	//Stamps and compresses request. Needs writeLock
+	bool queueAsync(std::string_view request, const SharedMemoryHandlerInternal::MessageStamp& stamp, uint64_t* streamOffset = nullptr);
+	bool queueFrame(SharedMemoryHandlerInternal::PipeFrameKind kind, uint32_t sequence, std::string_view payload, uint64_t* streamOffset = nullptr); //Needs writeLock
+	void flushSendBuffer(); //Needs writeLock, doesn't block
+	void receiveFrames(); //Needs readLock, doesn't block
+	bool sendSyncRequest(std::string_view request); //Needs syncLock, true once the answer is in syncAnswer
+	bool addKeyedRequest(std::string_view request, const std::string& key, const SharedMemoryHandlerInternal::MessageStamp& stamp); //Needs writeLock
+	void flushParkedMessages(); //Needs writeLock
+
+	//Platform specific, PipeTransportWin32.cpp and PipeTransportPosix.cpp
+	bool openPipe();
+	void closePipe();
+	bool writeSome(const char* data, size_t length, size_t& written); //false if the connection broke, written is 0 if the pipe is full
+	bool readSome(char* data, size_t length, size_t& read); //false if the connection broke, read is 0 if there is nothing
+	void waitReadable(std::chrono::milliseconds timeout);
+#ifdef _WIN32
+	HANDLE hPipe = INVALID_HANDLE_VALUE;
+#else
+	int socketFd = -1;
+#endif
+	std::string path;
+
+	//Lock order is connectionLock, pendingRequestsLock, syncLock, writeLock, readLock. Nothing blocks while holding writeLock or readLock
+	std::mutex connectionLock;
+	std::atomic<bool> connected{ false };
+	std::atomic<bool> connectionLost{ false }; //Seen by a read or write, isReady disconnects
+
+	std::mutex writeLock;
+	std::vector<char> sendBuffer; //Frames, everything before sendBufferHead is written already
+	size_t sendBufferHead = 0;
+	uint64_t sendBufferOffset = 0; //Stream offset of sendBuffer[0]
+	std::atomic<uint32_t> queuedBytes{ 0 }; //Not written yet
+	bool hasParkedMessages = false;
+	std::unordered_map<std::string, uint64_t> keyedFrameOffsets; //Stream offset of the last frame per key
+	std::unordered_map<std::string, ParkedMessage> parkedKeyedMessages; //Didn't fit into the send buffer yet
+
+	std::mutex readLock;
+	SharedMemoryHandlerInternal::PipeFrameReader reader;
+	std::vector<std::pair<uint32_t, std::string>> readCompletions; //Go to receivedCompletions under pendingRequestsLock
+	bool helloReceived = false;
+	uint32_t awaitedSyncSequence = 0;
+	bool syncAnswered = false;
+	std::string syncAnswer; //Keeps its capacity, no allocation per sync request
+
+	std::mutex syncLock; //One sync request at a time
+	uint32_t syncSequence = 0;
+
+	std::atomic<uint32_t> negotiatedCapabilities{ 0 };
+	std::atomic<bool> configNeedsRefresh{ false };
+	mutable SharedMemoryHandlerInternal::TransportTelemetry telemetry;
+	SharedMemoryHandlerInternal::ConsumerTelemetry consumerTelemetry; //Written under readLock
+
+	//Reconnect state
+	static constexpr std::chrono::milliseconds minReconnectBackoff = 50ms;
+	static constexpr std::chrono::milliseconds maxReconnectBackoff = 2s;
+	bool hadSession = false;
+	std::atomic<bool> sessionChanged{ false }; //Handled by pollCompletions
+	std::chrono::milliseconds reconnectBackoff = minReconnectBackoff;
+	std::chrono::steady_clock::time_point nextConnectAttempt;
+};
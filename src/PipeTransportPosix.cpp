@@ -0,0 +1,76 @@
+#ifndef _WIN32
+#include "PipeTransport.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL //macOS, SO_NOSIGPIPE is set on the socket instead
+#define MSG_NOSIGNAL 0
+#endif
+
+bool PipeTransport::openPipe() {
+	const std::string& socketPath = path.empty() ? std::string(PIPE_POSIX_PATH) : path;
+	sockaddr_un address{};
+	address.sun_family = AF_UNIX;
+	if (socketPath.length() >= sizeof(address.sun_path)) {
+		errorMessage = "TFAR ERR Pipe path too long";
+		return false;
+	}
+	memcpy(address.sun_path, socketPath.c_str(), socketPath.length() + 1);
+
+	socketFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (socketFd == -1) {
+		errorMessage = std::string("TFAR ERR Socket ") + strerror(errno);
+		return false;
+	}
+#ifdef SO_NOSIGPIPE
+	int noSigPipe = 1;
+	setsockopt(socketFd, SOL_SOCKET, SO_NOSIGPIPE, &noSigPipe, sizeof(noSigPipe));
+#endif
+	if (connect(socketFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1) {
+		if (errno != ENOENT && errno != ECONNREFUSED) //TeamSpeak just isn't running
+			errorMessage = std::string("TFAR ERR Connect ") + strerror(errno);
+		closePipe();
+		return false;
+	}
+	//Connect blocking, it's local and instant. Everything after never blocks
+	fcntl(socketFd, F_SETFL, fcntl(socketFd, F_GETFL) | O_NONBLOCK);
+	return true;
+}
+
+void PipeTransport::closePipe() {
+	if (socketFd == -1) return;
+	close(socketFd);
+	socketFd = -1;
+}
+
+bool PipeTransport::writeSome(const char* data, size_t length, size_t& written) {
+	written = 0;
+	const auto result = send(socketFd, data, length, MSG_NOSIGNAL);
+	if (result >= 0) {
+		written = static_cast<size_t>(result);
+		return true;
+	}
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+bool PipeTransport::readSome(char* data, size_t length, size_t& read) {
+	read = 0;
+	const auto result = recv(socketFd, data, length, 0);
+	if (result > 0) {
+		read = static_cast<size_t>(result);
+		return true;
+	}
+	if (result == 0) return false; //TeamSpeak closed it
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+void PipeTransport::waitReadable(std::chrono::milliseconds timeout) {
+	pollfd descriptor{ socketFd, POLLIN, 0 };
+	poll(&descriptor, 1, static_cast<int>(timeout.count()));
+}
+#endif
@@ -0,0 +1,72 @@
+#ifdef _WIN32
+#include "PipeTransport.hpp"
+#include <algorithm>
+#include <string>
+
+std::string GetLastErrorString(); //SharedMemoryTransferWin32.cpp
+
+bool PipeTransport::openPipe() {
+	if (path.empty())
+		hPipe = CreateFileW(PIPE_NAME, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+	else
+		hPipe = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+	if (hPipe == INVALID_HANDLE_VALUE) {
+		const auto error = GetLastError();
+		if (error != ERROR_FILE_NOT_FOUND && error != ERROR_PIPE_BUSY) //TeamSpeak just isn't running or busy with another client
+			errorMessage = "TFAR ERR OpenPipe " + GetLastErrorString();
+		return false;
+	}
+	//Byte stream like the Unix socket. Nonblocking, a full pipe must never stall the game
+	DWORD mode = PIPE_READMODE_BYTE | PIPE_NOWAIT;
+	if (!SetNamedPipeHandleState(hPipe, &mode, NULL, NULL)) {
+		errorMessage = "TFAR ERR PipeMode " + GetLastErrorString();
+		closePipe();
+		return false;
+	}
+	return true;
+}
+
+void PipeTransport::closePipe() {
+	if (hPipe == INVALID_HANDLE_VALUE) return;
+	CloseHandle(hPipe);
+	hPipe = INVALID_HANDLE_VALUE;
+}
+
+bool PipeTransport::writeSome(const char* data, size_t length, size_t& written) {
+	DWORD bytesWritten = 0;
+	//Nonblocking byte mode writes what fits and returns right away
+	if (!WriteFile(hPipe, data, static_cast<DWORD>((std::min)(length, size_t(64 * 1024))), &bytesWritten, NULL)) {
+		written = 0;
+		return false;
+	}
+	written = bytesWritten;
+	return true;
+}
+
+bool PipeTransport::readSome(char* data, size_t length, size_t& read) {
+	read = 0;
+	DWORD available = 0;
+	if (!PeekNamedPipe(hPipe, NULL, 0, NULL, &available, NULL))
+		return false;
+	if (available == 0) return true;
+	DWORD bytesRead = 0;
+	if (!ReadFile(hPipe, data, static_cast<DWORD>((std::min)(length, size_t(available))), &bytesRead, NULL))
+		return GetLastError() == ERROR_NO_DATA;
+	read = bytesRead;
+	return true;
+}
+
+void PipeTransport::waitReadable(std::chrono::milliseconds timeout) {
+	//Named pipes can't be waited on without overlapped IO. Spin briefly for a fast answer, then sleep
+	const auto deadline = std::chrono::steady_clock::now() + timeout;
+	for (int spins = 0; std::chrono::steady_clock::now() < deadline; ++spins) {
+		DWORD available = 0;
+		if (!PeekNamedPipe(hPipe, NULL, 0, NULL, &available, NULL) || available > 0)
+			return;
+		if (spins < 200)
+			YieldProcessor();
+		else
+			Sleep(1);
+	}
+}
+#endif
@@ -23,21 +23,6 @@ std::chrono::milliseconds timeInterp(std::chrono::milliseconds value, std::chron
     return std::chrono::milliseconds(minTime.count() + ((maxTime - minTime).count() * (value - minValue).count() / (maxValue - minValue).count()));
 }
 
-std::string vectorToString(const vector3& vec) {
-    std::string ret;
-    ret.reserve(7);
-    ret += "["sv;
-    ret += std::to_string(vec.x);
-    ret += ","sv;
-    ret += std::to_string(vec.y);
-    ret += ","sv;
-    ret += std::to_string(vec.z);
-    ret += "]"sv;
-    return ret;
-}
-
-
-
 PlayerInfo::PlayerInfo(std::shared_ptr<MainthreadScheduler> sched, object unit) :
     scheduler(std::move(sched)),
     controlledUnit(unit),
@@ -163,6 +148,11 @@ void PlayerInfo::simulate() {
     }
 }
 
+void PlayerInfo::resendFullState() {
+    hasPositionBaseline = false;
+    lastUpdateSent = {};
+}
+
 void PlayerInfo::updateIntervals() {
     auto currentUnit = Controller::get().currentUnit;
     if (!currentUnit) return;
@@ -183,7 +173,7 @@ void PlayerInfo::sendToTeamspeak() {
     auto currentUnit = Controller::get().currentUnit;
     if (!currentUnit) return;
 
-    if (!Controller::get().networkHandler.canDoAsyncRequest()) return;
+    if (!Controller::get().networkHandler->canDoAsyncRequest(MessageLane::Realtime)) return; //Where position batches go, a full Bulk lane must not hold them back
 
     auto curPos = position->get();
     bool isolatedInside = isolatedAndInside->get();
@@ -229,34 +219,25 @@ void PlayerInfo::sendToTeamspeak() {
     }
 
 
-    std::string data;
-    data.reserve(512);
-    data += "POS\t"sv;
-    data += unitName;
-    data += "\t";
-    data += vectorToString(curPos.eyePos);
-    data += "\t";
-    data += vectorToString(curPos.eyeDirection);
-    data += "\t";
-    data += canSpeak ? "1"sv : "0"sv;
-    data += "\t";
-    data += useSR ? "1"sv : "0"sv;
-    data += "\t";
-    data += useSR ? "1"sv : "0"sv;
-    data += "\t";
-    data += useDD ? "1"sv : "0"sv;
-    data += "\t";
-    data += vehicleID->get();
-    data += "\t";
-    data += std::to_string(terrainInterception);
-    data += "\t";
-    data += "1"; //#TODO //_unit getVariable["tf_voiceVolume", 1.0]
-    data += "\t";
-    data += std::to_string(objectInterception);
-    data += "\t";
-    data += isSpectating->get() ? "1"sv : "0"sv;
-    data += "\t";
-    data += isEnemy ? "1"sv : "0"sv;
+    r_string vehicle = vehicleID->get(); //Keep alive, update only references it
+
+    PositionUpdate update;
+    update.unitName = unitName;
+    update.eyePos[0] = curPos.eyePos.x;
+    update.eyePos[1] = curPos.eyePos.y;
+    update.eyePos[2] = curPos.eyePos.z;
+    update.eyeDirection[0] = curPos.eyeDirection.x;
+    update.eyeDirection[1] = curPos.eyeDirection.y;
+    update.eyeDirection[2] = curPos.eyeDirection.z;
+    update.canSpeak = canSpeak;
+    update.useSR = useSR;
+    update.useLR = useLR;
+    update.useDD = useDD;
+    update.vehicleID = static_cast<std::string_view>(vehicle);
+    update.terrainInterception = terrainInterception;
+    update.objectInterception = objectInterception;
+    update.isSpectating = isSpectating->get();
+    update.isEnemy = isEnemy;
 
     //private _data = [
     //    "POS	%1	%2	%3	%4	%5	%6	%7	%8	%9	%10	%11	%12	%13",
@@ -271,8 +252,8 @@ void PlayerInfo::sendToTeamspeak() {
 
     //#TODO if data is same as last time, then only send every second
 
-    std::string answ;
-    Controller::get().networkHandler.doSyncRequest(data, answ);
+    //Sent by Controller::threadWork once all players are simulated
+    Controller::get().appendPositionRecord(*this, update, position->getLastSample());
 
     lastUpdateSent = std::chrono::system_clock::now();
 }
@@ -335,7 +316,7 @@ void PlayerInfo::updateRadios() {
 
 }
 
-void PlayerInfo::grabRadios(auto_array<r_string>& radioData) {
+void PlayerInfo::grabRadios(std::string& radioData) {
     ittScope sc(PlayerInfoDomain, PlayerInfo_grabRadios);
     radioUpdate->get(); //trigger update
 
@@ -345,7 +326,8 @@ void PlayerInfo::grabRadios(auto_array<r_string>& radioData) {
         if (!it->speakerEnabled->get()) continue;
         if (it->frequencies->get().empty()) continue;
 
-        radioData.emplace_back(it->buildString(*this));
+        it->appendString(*this, radioData);
+        radioData += '\xB';
     }
 }
 
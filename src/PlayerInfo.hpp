@@ -3,6 +3,7 @@
 #include <memory>
 #include <string>
 #include "CachedVariable.hpp"
+#include "PositionRecord.hpp"
 #include "RadioInfo.hpp"
 
 
@@ -24,8 +25,10 @@ public:
     void simulate();
     void updateIntervals();
     void sendToTeamspeak();
+    void resendFullState(); //Next simulate sends a keyframe right away
     void updateRadios();
-    void grabRadios(auto_array<r_string>& radioData);
+    //Appends every active speaker radio, each terminated by "\xB"
+    void grabRadios(std::string& radioData);
 
 
 
@@ -85,5 +88,10 @@ public:
     std::chrono::system_clock::time_point lastUpdateSent;
 
     std::chrono::milliseconds updateSendDelay;
+
+    //Delta encoding, only touched by worker thread. See Controller::appendPositionRecord
+    PositionState sentPosition; //What TeamSpeak has once it processed everything we sent
+    bool hasPositionBaseline = false; //False if a frame failed, the next update has to be a keyframe
+    std::chrono::steady_clock::time_point lastPositionKeyframe;
 };
 
@@ -0,0 +1,204 @@
+#include "PositionRecord.hpp"
+#include <cstring>
+
+using namespace std::string_view_literals;
+
+static void appendVector(const float (&vec)[3], std::string& out) {
+    out += "["sv;
+    out += std::to_string(vec[0]);
+    out += ","sv;
+    out += std::to_string(vec[1]);
+    out += ","sv;
+    out += std::to_string(vec[2]);
+    out += "]"sv;
+}
+
+static bool hasFlag(uint16_t flags, PositionFlags flag) {
+    return (flags & static_cast<uint16_t>(flag)) != 0;
+}
+
+template <class Type>
+static void appendRaw(const Type& value, std::string& out) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(Type));
+}
+
+template <class Type>
+static bool readRaw(std::string_view& input, Type& value) {
+    if (input.length() < sizeof(Type)) return false;
+    memcpy(&value, input.data(), sizeof(Type));
+    input.remove_prefix(sizeof(Type));
+    return true;
+}
+
+static bool hasField(uint16_t fieldMask, PositionDeltaFields field) {
+    return (fieldMask & static_cast<uint16_t>(field)) != 0;
+}
+
+void PositionState::assign(const PositionUpdate& update) {
+    memcpy(eyePos, update.eyePos, sizeof(eyePos));
+    memcpy(eyeDirection, update.eyeDirection, sizeof(eyeDirection));
+    flags = PositionRecord::getFlags(update);
+    vehicleID.assign(update.vehicleID);
+    terrainInterception = update.terrainInterception;
+    voiceVolume = update.voiceVolume;
+    objectInterception = update.objectInterception;
+}
+
+void PositionState::apply(const PositionState& delta, uint16_t fieldMask) {
+    if (hasField(fieldMask, PositionDeltaFields::Position)) memcpy(eyePos, delta.eyePos, sizeof(eyePos));
+    if (hasField(fieldMask, PositionDeltaFields::Direction)) memcpy(eyeDirection, delta.eyeDirection, sizeof(eyeDirection));
+    if (hasField(fieldMask, PositionDeltaFields::Flags)) flags = delta.flags;
+    if (hasField(fieldMask, PositionDeltaFields::VehicleID)) vehicleID = delta.vehicleID;
+    if (hasField(fieldMask, PositionDeltaFields::TerrainInterception)) terrainInterception = delta.terrainInterception;
+    if (hasField(fieldMask, PositionDeltaFields::VoiceVolume)) voiceVolume = delta.voiceVolume;
+    if (hasField(fieldMask, PositionDeltaFields::ObjectInterception)) objectInterception = delta.objectInterception;
+}
+
+uint16_t PositionRecord::getFlags(const PositionUpdate& update) {
+    uint16_t flags = 0;
+    if (update.canSpeak) flags |= static_cast<uint16_t>(PositionFlags::CanSpeak);
+    if (update.useSR) flags |= static_cast<uint16_t>(PositionFlags::UseSR);
+    if (update.useLR) flags |= static_cast<uint16_t>(PositionFlags::UseLR);
+    if (update.useDD) flags |= static_cast<uint16_t>(PositionFlags::UseDD);
+    if (update.isSpectating) flags |= static_cast<uint16_t>(PositionFlags::Spectating);
+    if (update.isEnemy) flags |= static_cast<uint16_t>(PositionFlags::Enemy);
+    return flags;
+}
+
+void PositionRecord::encodeText(const PositionUpdate& update, std::string& out) {
+    out += "POS\t"sv;
+    out += update.unitName;
+    out += "\t";
+    appendVector(update.eyePos, out);
+    out += "\t";
+    appendVector(update.eyeDirection, out);
+    out += "\t";
+    out += update.canSpeak ? "1"sv : "0"sv;
+    out += "\t";
+    out += update.useSR ? "1"sv : "0"sv;
+    out += "\t";
+    out += update.useLR ? "1"sv : "0"sv;
+    out += "\t";
+    out += update.useDD ? "1"sv : "0"sv;
+    out += "\t";
+    out += update.vehicleID;
+    out += "\t";
+    out += std::to_string(update.terrainInterception);
+    out += "\t";
+    out += "1"; //#TODO //_unit getVariable["tf_voiceVolume", 1.0]
+    out += "\t";
+    out += std::to_string(update.objectInterception);
+    out += "\t";
+    out += update.isSpectating ? "1"sv : "0"sv;
+    out += "\t";
+    out += update.isEnemy ? "1"sv : "0"sv;
+}
+
+void PositionRecord::encodeBinary(const PositionUpdate& update, std::string& out) {
+    BinaryPositionRecord record;
+    record.unitNameLength = static_cast<uint16_t>(update.unitName.length());
+    record.vehicleIDLength = static_cast<uint16_t>(update.vehicleID.length());
+    record.recordSize = static_cast<uint16_t>(sizeof(BinaryPositionRecord) + record.unitNameLength + record.vehicleIDLength);
+
+    record.flags = getFlags(update);
+
+    memcpy(record.eyePos, update.eyePos, sizeof(record.eyePos));
+    memcpy(record.eyeDirection, update.eyeDirection, sizeof(record.eyeDirection));
+    record.terrainInterception = update.terrainInterception;
+    record.voiceVolume = update.voiceVolume;
+    record.objectInterception = update.objectInterception;
+
+    out.append(reinterpret_cast<const char*>(&record), sizeof(record));
+    out.append(update.unitName.data(), record.unitNameLength);
+    out.append(update.vehicleID.data(), record.vehicleIDLength);
+}
+
+bool PositionRecord::decodeBinary(std::string_view& input, PositionUpdate& update) {
+    if (input.length() < sizeof(BinaryPositionRecord)) return false;
+    BinaryPositionRecord record;
+    memcpy(&record, input.data(), sizeof(record));
+    if (record.recordSize > input.length() ||
+        record.recordSize != sizeof(BinaryPositionRecord) + record.unitNameLength + record.vehicleIDLength)
+        return false;
+
+    update.unitName = input.substr(sizeof(BinaryPositionRecord), record.unitNameLength);
+    update.vehicleID = input.substr(sizeof(BinaryPositionRecord) + record.unitNameLength, record.vehicleIDLength);
+    memcpy(update.eyePos, record.eyePos, sizeof(record.eyePos));
+    memcpy(update.eyeDirection, record.eyeDirection, sizeof(record.eyeDirection));
+    update.canSpeak = hasFlag(record.flags, PositionFlags::CanSpeak);
+    update.useSR = hasFlag(record.flags, PositionFlags::UseSR);
+    update.useLR = hasFlag(record.flags, PositionFlags::UseLR);
+    update.useDD = hasFlag(record.flags, PositionFlags::UseDD);
+    update.isSpectating = hasFlag(record.flags, PositionFlags::Spectating);
+    update.isEnemy = hasFlag(record.flags, PositionFlags::Enemy);
+    update.terrainInterception = record.terrainInterception;
+    update.voiceVolume = record.voiceVolume;
+    update.objectInterception = record.objectInterception;
+
+    input.remove_prefix(record.recordSize);
+    return true;
+}
+
+uint16_t PositionRecord::encodeDelta(const PositionUpdate& update, const PositionState* base, std::string& out) {
+    uint16_t fieldMask = static_cast<uint16_t>(PositionDeltaFields::All);
+    if (base) {
+        fieldMask = 0;
+        const auto flags = getFlags(update);
+        if (memcmp(base->eyePos, update.eyePos, sizeof(update.eyePos)) != 0) fieldMask |= static_cast<uint16_t>(PositionDeltaFields::Position);
+        if (memcmp(base->eyeDirection, update.eyeDirection, sizeof(update.eyeDirection)) != 0) fieldMask |= static_cast<uint16_t>(PositionDeltaFields::Direction);
+        if (base->flags != flags) fieldMask |= static_cast<uint16_t>(PositionDeltaFields::Flags);
+        if (base->vehicleID != update.vehicleID) fieldMask |= static_cast<uint16_t>(PositionDeltaFields::VehicleID);
+        if (base->terrainInterception != update.terrainInterception) fieldMask |= static_cast<uint16_t>(PositionDeltaFields::TerrainInterception);
+        if (base->voiceVolume != update.voiceVolume) fieldMask |= static_cast<uint16_t>(PositionDeltaFields::VoiceVolume);
+        if (base->objectInterception != update.objectInterception) fieldMask |= static_cast<uint16_t>(PositionDeltaFields::ObjectInterception);
+    }
+
+    const auto recordStart = out.length();
+    BinaryPositionDeltaHeader header{ 0, fieldMask, static_cast<uint16_t>(update.unitName.length()) };
+    appendRaw(header, out);
+    out += update.unitName;
+
+    if (hasField(fieldMask, PositionDeltaFields::Position)) appendRaw(update.eyePos, out);
+    if (hasField(fieldMask, PositionDeltaFields::Direction)) appendRaw(update.eyeDirection, out);
+    if (hasField(fieldMask, PositionDeltaFields::Flags)) appendRaw(getFlags(update), out);
+    if (hasField(fieldMask, PositionDeltaFields::VehicleID)) {
+        appendRaw(static_cast<uint16_t>(update.vehicleID.length()), out);
+        out += update.vehicleID;
+    }
+    if (hasField(fieldMask, PositionDeltaFields::TerrainInterception)) appendRaw(update.terrainInterception, out);
+    if (hasField(fieldMask, PositionDeltaFields::VoiceVolume)) appendRaw(update.voiceVolume, out);
+    if (hasField(fieldMask, PositionDeltaFields::ObjectInterception)) appendRaw(update.objectInterception, out);
+
+    //Patch in final size
+    const auto recordSize = static_cast<uint16_t>(out.length() - recordStart);
+    memcpy(out.data() + recordStart, &recordSize, sizeof(recordSize));
+    return fieldMask;
+}
+
+bool PositionRecord::decodeDelta(std::string_view& input, std::string_view& unitName, uint16_t& fieldMask, PositionState& delta) {
+    BinaryPositionDeltaHeader header;
+    auto record = input;
+    if (!readRaw(record, header)) return false;
+    if (header.recordSize > input.length() || header.recordSize < sizeof(header) + header.unitNameLength) return false;
+    record = input.substr(sizeof(header), header.recordSize - sizeof(header));
+
+    unitName = record.substr(0, header.unitNameLength);
+    record.remove_prefix(header.unitNameLength);
+    fieldMask = header.fieldMask;
+
+    if (hasField(fieldMask, PositionDeltaFields::Position) && !readRaw(record, delta.eyePos)) return false;
+    if (hasField(fieldMask, PositionDeltaFields::Direction) && !readRaw(record, delta.eyeDirection)) return false;
+    if (hasField(fieldMask, PositionDeltaFields::Flags) && !readRaw(record, delta.flags)) return false;
+    if (hasField(fieldMask, PositionDeltaFields::VehicleID)) {
+        uint16_t length;
+        if (!readRaw(record, length) || record.length() < length) return false;
+        delta.vehicleID.assign(record.substr(0, length));
+        record.remove_prefix(length);
+    }
+    if (hasField(fieldMask, PositionDeltaFields::TerrainInterception) && !readRaw(record, delta.terrainInterception)) return false;
+    if (hasField(fieldMask, PositionDeltaFields::VoiceVolume) && !readRaw(record, delta.voiceVolume)) return false;
+    if (hasField(fieldMask, PositionDeltaFields::ObjectInterception) && !readRaw(record, delta.objectInterception)) return false;
+
+    input.remove_prefix(header.recordSize);
+    return true;
+}
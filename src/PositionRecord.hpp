@@ -0,0 +1,102 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/*
+One player position update as sent inside a POSBATCH frame, or on its own without TransportCapability::PositionBatches.
+Text encoding is the classic "POS\t..." line. Binary encoding is only used if TeamSpeak announced
+TransportCapability::BinaryPositions, it's a fixed BinaryPositionRecord followed by unitName and vehicleID bytes.
+Fields mean the same in every encoding. useSR, useLR and useDD are whether the unit can use a radio of that kind right now,
+the text fields after canSpeak are the same as the SQF "POS" line sent (_useSw, _useLr, _useDd).
+
+Delta encoding (TransportCapability::PositionDeltas) only carries the fields that changed compared to the last state the
+game sent for that unit, without waiting for TeamSpeak to acknowledge it. That works because TeamSpeak applies frames in
+the order they were sent. If a frame fails or times out the game drops its baseline and the unit's next record is a keyframe,
+it also sends one every couple of seconds anyway. It's a BinaryPositionDeltaHeader, the unitName bytes and then the value
+of every field set in fieldMask, in PositionDeltaFields bit order. Keyframes have every field set and TeamSpeak replaces its state.
+*/
+struct PositionUpdate {
+    std::string_view unitName;
+    float eyePos[3]{};
+    float eyeDirection[3]{};
+    bool canSpeak = false;
+    bool useSR = false;
+    bool useLR = false;
+    bool useDD = false;
+    std::string_view vehicleID;
+    float terrainInterception = 0;
+    float voiceVolume = 1;
+    float objectInterception = 0;
+    bool isSpectating = false;
+    bool isEnemy = false;
+};
+
+enum class PositionFlags : uint16_t {
+    CanSpeak = 1 << 0,
+    UseSR = 1 << 1,
+    UseLR = 1 << 2,
+    UseDD = 1 << 3,
+    Spectating = 1 << 4,
+    Enemy = 1 << 5
+};
+
+enum class PositionDeltaFields : uint16_t {
+    Keyframe = 1 << 0,
+    Position = 1 << 1, //float[3]
+    Direction = 1 << 2, //float[3]
+    Flags = 1 << 3, //uint16_t PositionFlags
+    VehicleID = 1 << 4, //uint16_t length + bytes
+    TerrainInterception = 1 << 5, //float
+    VoiceVolume = 1 << 6, //float
+    ObjectInterception = 1 << 7, //float
+    All = 0xFF
+};
+
+//Owning copy of the values of a PositionUpdate. What TeamSpeak knows about a unit
+struct PositionState {
+    float eyePos[3]{};
+    float eyeDirection[3]{};
+    uint16_t flags = 0;
+    std::string vehicleID;
+    float terrainInterception = 0;
+    float voiceVolume = 1;
+    float objectInterception = 0;
+
+    void assign(const PositionUpdate& update);
+    void apply(const PositionState& delta, uint16_t fieldMask); //Consumer side
+};
+
+#pragma pack(push, 1)
+struct BinaryPositionRecord {
+    uint16_t recordSize; //Including unitName and vehicleID bytes
+    uint16_t flags; //PositionFlags
+    float eyePos[3];
+    float eyeDirection[3];
+    float terrainInterception;
+    float voiceVolume;
+    float objectInterception;
+    uint16_t unitNameLength;
+    uint16_t vehicleIDLength;
+};
+struct BinaryPositionDeltaHeader {
+    uint16_t recordSize; //Including everything that follows
+    uint16_t fieldMask; //PositionDeltaFields
+    uint16_t unitNameLength;
+};
+#pragma pack(pop)
+static_assert(sizeof(BinaryPositionRecord) == 44, "BinaryPositionRecord layout is part of the protocol");
+static_assert(sizeof(BinaryPositionDeltaHeader) == 6, "BinaryPositionDeltaHeader layout is part of the protocol");
+
+namespace PositionRecord {
+    void encodeText(const PositionUpdate& update, std::string& out);
+    void encodeBinary(const PositionUpdate& update, std::string& out);
+    //Consumer side, reads one record from the front of input and advances it. Strings in update point into input
+    bool decodeBinary(std::string_view& input, PositionUpdate& update);
+
+    uint16_t getFlags(const PositionUpdate& update);
+    //base is the last state sent for the unit, nullptr sends a keyframe. Returns the fieldMask that was written
+    uint16_t encodeDelta(const PositionUpdate& update, const PositionState* base, std::string& out);
+    //Consumer side, delta receives only the fields in fieldMask. Apply them with PositionState::apply
+    bool decodeDelta(std::string_view& input, std::string_view& unitName, uint16_t& fieldMask, PositionState& delta);
+}
@@ -145,32 +145,34 @@ void RadioInfo::initValues() {
 
 
 
+}
+
+void RadioInfo::appendString(const PlayerInfo& player, std::string& out) const {
+    out += static_cast<std::string_view>(netID->get());
+    out += '\n';
+
+    const auto freqs = frequencies->get();
+    for (auto& it : freqs) {
+        out += static_cast<std::string_view>(it);
+        out += '|';
+    }
+    if (!freqs.empty())
+        out.pop_back();
+
+    out += '\n';
+    out += player.unitName;
+    out += "\n[]\n"sv; //Position
+    out += std::to_string(volume->get());
+    out += '\n';
+
+    out += static_cast<std::string_view>(player.vehicleID->get());
+    out += '\n';
+    out += std::to_string(player.position->get().eyePos.z);
 }
 
 std::string RadioInfo::buildString(const PlayerInfo& player) const {
     std::string ret;
     ret.reserve(128);
-
-    ret += netID->get();
-    ret += "\n";
-
-    std::string freqStr; //#TODO reserve
-    for (auto& it : frequencies->get()) {
-        freqStr += it;
-        freqStr += "|";
-    }
-    freqStr.pop_back();
-
-    ret += freqStr;
-    ret += "\n";
-    ret += player.unitName;
-    ret += "\n[]\n"; //Position
-    ret += std::to_string(volume->get());
-    ret += "\n";
-
-    ret += player.vehicleID->get();
-    ret += "\n";
-    ret += std::to_string(player.position->get().eyePos.z);
-
+    appendString(player, ret);
     return ret;
 }
@@ -35,4 +35,5 @@ public:
     CachedValueMTS<float> volume;
 
     std::string buildString(const PlayerInfo& player) const;
+    void appendString(const PlayerInfo& player, std::string& out) const;
 };
@@ -0,0 +1,88 @@
+#pragma once
+#ifndef _WIN32
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+POSIX counterpart of the named Win32 kernel objects.
+The data region is the shm object SHAREDMEM_POSIX_NAME with exactly the same layout as on Windows.
+Events and the mutex live in their own small shm object SHAREDMEM_POSIX_SYNC_NAME, just like the Win32 events
+and mutex are separate named objects. All of them are futex words, so waiting/waking is one syscall each.
+*/
+#define SHAREDMEM_POSIX_NAME "/TFARSHAMEM"
+#define SHAREDMEM_POSIX_SYNC_NAME "/TFARSHAMEM_SYNC"
+
+namespace SharedMemoryHandlerInternal {
+
+	inline long futexCall(std::atomic<uint32_t>* addr, int op, uint32_t value, const timespec* timeout = nullptr) {
+		static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex word must be plain 32bit");
+		//No FUTEX_PRIVATE_FLAG, the word is shared between processes
+		return syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), op, value, timeout, nullptr, 0);
+	}
+
+	inline timespec msToTimespec(uint32_t milliseconds) {
+		timespec ts;
+		ts.tv_sec = milliseconds / 1000;
+		ts.tv_nsec = static_cast<long>(milliseconds % 1000) * 1000000;
+		return ts;
+	}
+
+	//Manual reset event, same semantics as the Win32 events the consumer creates
+	struct FutexEvent {
+		std::atomic<uint32_t> state{ 0 };
+
+		void set() {
+			if (state.exchange(1, std::memory_order_release) == 0)
+				futexCall(&state, FUTEX_WAKE, INT32_MAX);
+		}
+		void reset() {
+			state.store(0, std::memory_order_relaxed);
+		}
+		bool wait(uint32_t timeoutMs) {
+			const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+			while (state.load(std::memory_order_acquire) == 0) {
+				const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+				if (remaining.count() <= 0) return false;
+				auto ts = msToTimespec(static_cast<uint32_t>(remaining.count()));
+				futexCall(&state, FUTEX_WAIT, 0, &ts); //Spurious wakeups and EAGAIN are handled by the loop
+			}
+			return true;
+		}
+	};
+
+	//0 unlocked, 1 locked, 2 locked with waiters
+	struct FutexMutex {
+		std::atomic<uint32_t> state{ 0 };
+
+		bool lock(uint32_t timeoutMs) {
+			uint32_t expected = 0;
+			if (state.compare_exchange_strong(expected, 1, std::memory_order_acquire))
+				return true;
+			const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+			while (state.exchange(2, std::memory_order_acquire) != 0) {
+				const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+				if (remaining.count() <= 0) return false;
+				auto ts = msToTimespec(static_cast<uint32_t>(remaining.count()));
+				futexCall(&state, FUTEX_WAIT, 2, &ts);
+			}
+			return true;
+		}
+		void unlock() {
+			if (state.exchange(0, std::memory_order_release) == 2)
+				futexCall(&state, FUTEX_WAKE, 1);
+		}
+	};
+
+	struct PosixSyncBlock {
+		FutexEvent eventRequest;
+		FutexEvent eventResponse;
+		FutexMutex mutex;
+	};
+}
+#endif
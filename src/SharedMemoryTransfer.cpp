@@ -1,139 +1,607 @@
 
 #include "SharedMemoryTransfer.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <stdexcept>
 #include <thread>
 #include <string>
+#include <vector>
 using namespace SharedMemoryHandlerInternal;
+using namespace std::string_literals;
+using namespace std::string_view_literals;
+
+template <typename Func>
+decltype(auto) SharedMemoryHandlerInternal::SharedMemoryData::withLaneArena(MessageLane lane, Func&& func) {
+	char* base = reinterpret_cast<char*>(this);
+	switch (lane) {
+		case MessageLane::Control: return func(*reinterpret_cast<ControlArena*>(base + SHAREDMEM_CONTROLARENA_OFFSET));
+		case MessageLane::Realtime: return func(*reinterpret_cast<RealtimeArena*>(base + SHAREDMEM_REALTIMEARENA_OFFSET));
+		default: return func(*reinterpret_cast<AsyncMessageArena*>(base + SHAREDMEM_ASYNCARENA_OFFSET));
+	}
+}
 
-bool SharedMemoryHandlerInternal::SharedMemoryData::canAddAsyncRequest() const {
-	return nextFreeAsyncMessage + 1 < SHAREDMEM_ASYNCMSG_COUNT;
+template <typename Func>
+decltype(auto) SharedMemoryHandlerInternal::SharedMemoryData::withLaneArena(MessageLane lane, Func&& func) const {
+	const char* base = reinterpret_cast<const char*>(this);
+	switch (lane) {
+		case MessageLane::Control: return func(*reinterpret_cast<const ControlArena*>(base + SHAREDMEM_CONTROLARENA_OFFSET));
+		case MessageLane::Realtime: return func(*reinterpret_cast<const RealtimeArena*>(base + SHAREDMEM_REALTIMEARENA_OFFSET));
+		default: return func(*reinterpret_cast<const AsyncMessageArena*>(base + SHAREDMEM_ASYNCARENA_OFFSET));
+	}
 }
 
-void SharedMemoryHandlerInternal::SharedMemoryData::addAsyncRequest(const std::string& req) {
-	setLastGameTick();
-	if (req.length() > SHAREDMEM_MAX_STRINGSIZE) {
-		MessageBoxA(0, (req + std::to_string(req.length())).c_str(), "TFAR SHAMEM Too big request", 0);
-		return; //#TODO Could try to open and use a NamedPipe instead as backup
+CompletionArena* SharedMemoryHandlerInternal::SharedMemoryData::getCompletionArena() {
+	return reinterpret_cast<CompletionArena*>(reinterpret_cast<char*>(this) + SHAREDMEM_COMPLETIONARENA_OFFSET);
+}
+
+TransportTelemetry* SharedMemoryHandlerInternal::SharedMemoryData::getTelemetry() {
+	return reinterpret_cast<TransportTelemetry*>(reinterpret_cast<char*>(this) + SHAREDMEM_TELEMETRY_OFFSET);
+}
+
+ConsumerTelemetry* SharedMemoryHandlerInternal::SharedMemoryData::getConsumerTelemetry() {
+	return reinterpret_cast<ConsumerTelemetry*>(reinterpret_cast<char*>(this) + SHAREDMEM_CONSUMERTELEMETRY_OFFSET);
+}
+
+MessageLane SharedMemoryHandlerInternal::SharedMemoryData::fitLane(MessageLane lane, size_t length) {
+	switch (lane) {
+		case MessageLane::Control: return length <= ControlArena::maxMessageSize ? lane : MessageLane::Bulk;
+		case MessageLane::Realtime: return length <= RealtimeArena::maxMessageSize ? lane : MessageLane::Bulk;
+		default: return MessageLane::Bulk;
 	}
-	SharedMemString* asyncBase = reinterpret_cast<SharedMemString*>(reinterpret_cast<char*>(this) + 128 + sizeof(SharedMemString) * 2);
-	if (nextFreeAsyncMessage > SHAREDMEM_ASYNCMSG_COUNT) {
-		return;
-		//Queue is full
+}
+
+uint32_t SharedMemoryHandlerInternal::SharedMemoryData::maxRecordSize(MessageLane lane) {
+	switch (lane) {
+		case MessageLane::Control: return ControlArena::maxRecordSize;
+		case MessageLane::Realtime: return RealtimeArena::maxRecordSize;
+		default: return AsyncMessageArena::maxRecordSize;
 	}
-	auto position = nextFreeAsyncMessage++;
+}
+
+bool SharedMemoryHandlerInternal::SharedMemoryData::canAddAsyncRequest(MessageLane lane) const {
+	//Callers don't tell us the size upfront, check for a typical big message
+	return withLaneArena(lane, [](const auto& arena) { return arena.canWrite(SHAREDMEM_MAX_STRINGSIZE); });
+}
+
+bool SharedMemoryHandlerInternal::SharedMemoryData::addAsyncRequest(std::string_view req, MessageLane lane, uint32_t* recordPosition) {
+	setLastGameTick();
+	//false if the lane is full or the message is bigger than its maxMessageSize, big messages are fragmented by the arena
+	const auto usedBytes = withLaneArena(lane, [req, recordPosition](auto& arena) -> int64_t {
+		return arena.write(req, recordPosition) ? static_cast<int64_t>(arena.usedBytes()) : -1;
+	});
+	if (usedBytes < 0)
+		return false;
+	getTelemetry()->countAsyncEnqueued(static_cast<uint32_t>(req.length()), static_cast<uint32_t>(usedBytes), lane);
+	return true;
+}
+
+bool SharedMemoryHandlerInternal::SharedMemoryData::skipAsyncRequest(MessageLane lane, uint32_t recordPosition) {
+	return withLaneArena(lane, [recordPosition](auto& arena) { return arena.skip(recordPosition); });
+}
+
+char* SharedMemoryHandlerInternal::SharedMemoryData::reserveAsyncRequest(MessageLane lane, uint32_t maxLength, uint32_t& recordPosition) {
+	return withLaneArena(lane, [maxLength, &recordPosition](auto& arena) { return arena.reserve(maxLength, recordPosition); });
+}
+
+void SharedMemoryHandlerInternal::SharedMemoryData::commitAsyncRequest(MessageLane lane, uint32_t recordPosition, uint32_t maxLength, uint32_t length, bool skipped) {
+	setLastGameTick();
+	const auto usedBytes = withLaneArena(lane, [=](auto& arena) {
+		arena.commit(recordPosition, maxLength, length, skipped);
+		return arena.usedBytes();
+	});
+	if (!skipped)
+		getTelemetry()->countAsyncEnqueued(length, usedBytes, lane);
+}
 
-	asyncBase[position] = req;
+bool SharedMemoryHandlerInternal::SharedMemoryData::popAsyncRequest(std::string& req) {
+	//Looks at the higher lanes again for every message, so a realtime message never waits for a whole bulk burst
+	for (auto lane : { MessageLane::Control, MessageLane::Realtime, MessageLane::Bulk })
+		if (withLaneArena(lane, [&req](auto& arena) { return arena.read(req); }))
+			return true;
+	return false;
 }
 
-void SharedMemoryHandlerInternal::SharedMemoryData::setSyncRequest(const std::string& req) {
+bool SharedMemoryHandlerInternal::SharedMemoryData::addCompletion(uint32_t requestID, const std::string& answer) {
+	std::string record = std::to_string(requestID);
+	record += '\t';
+	record += answer;
+	return getCompletionArena()->write(record);
+}
+
+bool SharedMemoryHandlerInternal::SharedMemoryData::popCompletion(uint32_t& requestID, std::string& answer) {
+	std::string record;
+	while (getCompletionArena()->read(record)) {
+		auto separator = record.find('\t');
+		if (separator == std::string::npos) continue; //Malformed, drop
+		requestID = static_cast<uint32_t>(std::strtoul(record.c_str(), nullptr, 10));
+		answer.assign(record, separator + 1);
+		return true;
+	}
+	return false;
+}
+
+uint32_t SharedMemoryHandlerInternal::SharedMemoryData::setSyncRequest(std::string_view req) {
 	setLastGameTick();
 	if (req.length() > SHAREDMEM_MAX_STRINGSIZE) {
-		MessageBoxA(0, (req + std::to_string(req.length())).c_str(), "TFAR SHAMEM Too big Srequest", 0);
-		__debugbreak();//Request bigger than max allowed size
-		return;
+		reportTooBigRequest(req, "TFAR SHAMEM Too big Srequest");//Request bigger than max allowed size
+		return 0;
 	}
-	SharedMemString* syncReq = reinterpret_cast<SharedMemString*>(reinterpret_cast<char*>(this) + 128);
+	SharedMemString* syncReq = reinterpret_cast<SharedMemString*>(reinterpret_cast<char*>(this) + SHAREDMEM_SYNCREQUEST_OFFSET);
 	*syncReq = req;
+	return syncRequestSequence.fetch_add(1, std::memory_order_release) + 1;
 }
 
 bool SharedMemoryHandlerInternal::SharedMemoryData::getSyncResponse(std::string& response) {
 	setLastGameTick();
-	SharedMemString* syncResp = reinterpret_cast<SharedMemString*>(reinterpret_cast<char*>(this) + 128 + sizeof(SharedMemString));
+	SharedMemString* syncResp = reinterpret_cast<SharedMemString*>(reinterpret_cast<char*>(this) + SHAREDMEM_SYNCANSWER_OFFSET);
 	return syncResp->assignToAndClear(response);
 }
 
+bool SharedMemoryHandlerInternal::SharedMemoryData::getSyncResponse(char* output, size_t outputSize) {
+	setLastGameTick();
+	SharedMemString* syncResp = reinterpret_cast<SharedMemString*>(reinterpret_cast<char*>(this) + SHAREDMEM_SYNCANSWER_OFFSET);
+	return syncResp->assignToAndClear(output, outputSize);
+}
+
+bool SharedMemoryHandlerInternal::SharedMemoryData::getSyncRequest(std::string& request) {
+	SharedMemString* syncReq = reinterpret_cast<SharedMemString*>(reinterpret_cast<char*>(this) + SHAREDMEM_SYNCREQUEST_OFFSET);
+	return syncReq->assignToAndClear(request);
+}
+
+void SharedMemoryHandlerInternal::SharedMemoryData::setSyncResponse(const std::string& answer) {
+	SharedMemString* syncResp = reinterpret_cast<SharedMemString*>(reinterpret_cast<char*>(this) + SHAREDMEM_SYNCANSWER_OFFSET);
+	*syncResp = answer;
+	//Answer has to be visible before the game sees the sequence
+	syncResponseSequence.store(syncRequestSequence.load(std::memory_order_acquire), std::memory_order_release);
+}
+
 bool SharedMemoryHandlerInternal::SharedMemoryData::hasAsyncRequest() const {
-	return nextFreeAsyncMessage > 0;
+	for (auto lane : { MessageLane::Control, MessageLane::Realtime, MessageLane::Bulk })
+		if (!withLaneArena(lane, [](const auto& arena) { return arena.empty(); }))
+			return true;
+	return false;
 }
 
 bool SharedMemoryHandlerInternal::SharedMemoryData::hasSyncRequest() const {
-	const SharedMemString* syncResp = reinterpret_cast<const SharedMemString*>(reinterpret_cast<const char*>(this) + 128);
+	const SharedMemString* syncResp = reinterpret_cast<const SharedMemString*>(reinterpret_cast<const char*>(this) + SHAREDMEM_SYNCREQUEST_OFFSET);
 	return syncResp->length > 0;
 }
 
-std::string GetLastErrorString() {
-	LPSTR messageBuffer = nullptr;
-	size_t size = FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
-		NULL, GetLastError(), MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPSTR) &messageBuffer, 0, NULL);
-	std::string message(messageBuffer, size);
+void SharedMemoryHandlerInternal::prefaultPages(const void* view, size_t size) {
+	constexpr size_t pageSize = 4096; //Smallest there is, bigger pages just get touched more than once
+	const volatile char* bytes = static_cast<const volatile char*>(view);
+	for (size_t offset = 0; offset < size; offset += pageSize)
+		(void)bytes[offset];
+}
+
+bool SharedMemoryHandlerInternal::parseMemMapMode(std::string_view name, uint32_t& mode) {
+	if (name == "lazy"sv)
+		mode = 0;
+	else if (name == "prefault"sv)
+		mode = static_cast<uint32_t>(MemMapMode::Prefault);
+	else if (name == "lock"sv)
+		mode = static_cast<uint32_t>(MemMapMode::Prefault) | static_cast<uint32_t>(MemMapMode::Lock);
+	else
+		return false;
+	return true;
+}
 
-	//Free the buffer.
-	LocalFree(messageBuffer);
-	return message;
+bool SharedMemoryHandler::MappingUse::acquire() {
+	if (held) return true;
+	auto users = handler.mappingUsers.load(std::memory_order_relaxed);
+	do {
+		if (users < 0 || (users & mappingDraining)) return false; //Being replaced, a call during a reconnect fails like one before it
+	} while (!handler.mappingUsers.compare_exchange_weak(users, users + 1, std::memory_order_acquire, std::memory_order_relaxed));
+	held = true;
+	if (handler.pMapView) return true;
+	release();
+	return false;
 }
 
-SharedMemoryHandler::SharedMemoryHandler() {
-	createMemMap();
+void SharedMemoryHandler::MappingUse::release() {
+	if (!held) return;
+	handler.mappingUsers.fetch_sub(1, std::memory_order_release);
+	held = false;
+}
+
+SharedMemoryHandler::SharedMemoryHandler(uint32_t _mappingMode) : mappingMode(_mappingMode) {
+	isReady();
 }
 
 SharedMemoryHandler::~SharedMemoryHandler() {  
 	shutdown();
-	if (pMapView) UnmapViewOfFile(pMapView);
-	if (hMapFile) CloseHandle(hMapFile);
-	if (hEventRequest) CloseHandle(hEventRequest);
-	if (hMutex) CloseHandle(hMutex);
+	releaseMemMap();
 }
 
-bool SharedMemoryHandler::canDoAsyncRequest() const {
-	MutexLock lock(hMutex);
-	if (!lock.isLocked())
-		return false;
+bool SharedMemoryHandler::canDoAsyncRequest(MessageLane lane) const {
+	MappingUse mapping(*this);
+	if (!mapping.acquire()) return false;
 	SharedMemoryData* pData = static_cast<SharedMemoryData*>(pMapView);
-	return pData->canAddAsyncRequest();
+	if (pData->canAddAsyncRequest(lane))
+		return true;
+	pData->getTelemetry()->asyncRejected.fetch_add(1, std::memory_order_relaxed);
+	return false;
 }
 
-bool SharedMemoryHandler::doSyncRequest(const std::string& request, std::string& answer) {
-	if (!isReady()) return false;
+bool SharedMemoryHandler::doSyncRequest(std::string_view request, std::string& answer) {
+	MappingUse mapping(*this);
+	if (!useMapping(mapping)) return false;
+	if (getCapture().isActive())
+		getCapture().record(CaptureRecordKind::Sync, request);
+	if (request.length() > SHAREDMEM_MAX_STRINGSIZE)
+		return doFragmentedSyncRequest(request, answer);
+	if (!sendSyncRequest(request))
+		return false;
+	return static_cast<SharedMemoryData*>(pMapView)->getSyncResponse(answer);
+}
+
+bool SharedMemoryHandler::doSyncRequest(std::string_view request, char* output, size_t outputSize) {
+	MappingUse mapping(*this);
+	if (!useMapping(mapping)) return false;
+	if (getCapture().isActive())
+		getCapture().record(CaptureRecordKind::Sync, request);
+	if (request.length() > SHAREDMEM_MAX_STRINGSIZE) {
+		std::string answer;
+		if (!doFragmentedSyncRequest(request, answer))
+			return false;
+		if (outputSize > 0) {
+			const auto copied = (std::min)(answer.length(), outputSize - 1);
+			memcpy(output, answer.data(), copied);
+			output[copied] = 0;
+		}
+		return true;
+	}
+	if (!sendSyncRequest(request))
+		return false;
+	return static_cast<SharedMemoryData*>(pMapView)->getSyncResponse(output, outputSize);
+}
+
+bool SharedMemoryHandler::sendSyncRequest(std::string_view request) {
 	MutexLock lock(hMutex);
 	if (!lock.isLocked())
 		return false;
 	SharedMemoryData* pData = static_cast<SharedMemoryData*>(pMapView);
-	pData->setSyncRequest(request);
+	auto sequence = pData->setSyncRequest(request);
 	lock.unlock();
-	SetEvent(hEventRequest);
-	auto waited = SignalObjectAndWait(hEventRequest, hEventResponse, PIPE_TIMEOUT, FALSE);
-	ResetEvent(hEventResponse);
-	if (waited != WAIT_OBJECT_0) {
-		return false;
+	//No need to lock again for reading the answer. see SharedMemoryHandler::doSyncAndAsyncRequest
+	return signalSyncRequestAndWait(sequence);
+}
+
+bool SharedMemoryHandler::doAsyncRequest(std::string_view request, MessageLane lane, std::chrono::steady_clock::time_point captureTime) {
+	MappingUse mapping(*this);
+	if (!useMapping(mapping)) return false;
+	if (getCapture().isActive())
+		getCapture().record(CaptureRecordKind::Async, request, {}, lane);
+	flushParkedMessagesIfAny();
+	KeyedPosition position;
+	if (addAsyncMessage(request, makeMessageStamp(lane, captureTime), position))
+		return true;
+	static_cast<SharedMemoryData*>(pMapView)->getTelemetry()->countAsyncDropped(position.lane);
+	return false;
+}
+
+bool SharedMemoryHandler::doAsyncRequest(std::string_view request, const std::string& key, MessageLane lane, std::chrono::steady_clock::time_point captureTime) {
+	MappingUse mapping(*this);
+	if (!useMapping(mapping)) return false;
+	if (getCapture().isActive())
+		getCapture().record(CaptureRecordKind::Async, request, key, lane);
+	std::unique_lock lock(keyedMessagesLock);
+	flushParkedMessages();
+	const auto stamp = makeMessageStamp(lane, captureTime); //A parked message keeps its enqueue time, waiting is part of the delay
+	if (!addKeyedRequest(request, key, stamp)) {
+		auto [parked, inserted] = parkedKeyedMessages.try_emplace(key, ParkedMessage{ std::string(request), stamp });
+		if (!inserted) { //Replaces older parked one, that one never reaches TeamSpeak
+			parked->second = ParkedMessage{ std::string(request), stamp };
+			static_cast<SharedMemoryData*>(pMapView)->getTelemetry()->countAsyncDropped(lane);
+		}
+		hasParkedMessages = true;
 	}
-	//lock.lock();//No need to lock again. see SharedMemoryHandler::doSyncAndAsyncRequest
-	//if (!lock.isLocked())
-	//	return false;
-	return pData->getSyncResponse(answer);
+	return true;
 }
 
-bool SharedMemoryHandler::doAsyncRequest(const std::string& request) {
-	if (!isReady()) return false;
-	MutexLock lock(hMutex);
-	if (!lock.isLocked())
+bool SharedMemoryHandler::addAsyncMessage(std::string_view request, const MessageStamp& stamp, KeyedPosition& position) {
+	SharedMemoryData* pData = static_cast<SharedMemoryData*>(pMapView);
+	const auto message = compressAsyncRequest(stampAsyncRequest(request, stamp), pData->getTelemetry());
+	position.lane = SharedMemoryData::fitLane(stamp.lane, message.length());
+	return pData->addAsyncRequest(message, position.lane, &position.recordPosition);
+}
+
+bool SharedMemoryHandler::addKeyedRequest(std::string_view request, const std::string& key, const MessageStamp& stamp) {
+	KeyedPosition position;
+	if (!addAsyncMessage(request, stamp, position))
 		return false;
+	parkedKeyedMessages.erase(key); //We just sent a newer one
+	replaceKeyedRequest(key, position);
+	return true;
+}
+
+void SharedMemoryHandler::replaceKeyedRequest(const std::string& key, KeyedPosition position) {
+	SharedMemoryData* pData = static_cast<SharedMemoryData*>(pMapView);
+	auto found = keyedMessagePositions.find(key);
+	if (found != keyedMessagePositions.end()) {
+		//Only after the new one is in, TeamSpeak always has at least one of them
+		pData->skipAsyncRequest(found->second.lane, found->second.recordPosition);
+		found->second = position;
+	} else {
+		keyedMessagePositions.emplace(key, position);
+	}
+}
+
+SharedMemoryHandler::AsyncWriter SharedMemoryHandler::reserveAsyncRequest(uint32_t maxLength, MessageLane lane, std::chrono::steady_clock::time_point captureTime) {
+	AsyncWriter writer;
+	MappingUse mapping(*this);
+	if (!useMapping(mapping)) return writer;
+	flushParkedMessagesIfAny();
 	SharedMemoryData* pData = static_cast<SharedMemoryData*>(pMapView);
-	pData->addAsyncRequest(request);
+	const uint32_t stampLength = isCapabilityActive(TransportCapability::MessageTimestamps) ? MESSAGE_STAMP_LENGTH : 0;
+	if (maxLength + stampLength > SharedMemoryData::maxRecordSize(lane))
+		lane = MessageLane::Bulk;
+	//If the stamp doesn't leave room for maxLength in one record the writer gets less, callers handle overflow anyway
+	const auto reserved = (std::min)(maxLength + stampLength, SharedMemoryData::maxRecordSize(lane));
+	char* record = pData->reserveAsyncRequest(lane, reserved, writer.recordPosition);
+	if (!record) return writer;
+	writer.buffer = record + stampLength;
+	writer.lane = lane;
+	writer.captureTime = captureTime;
+	writer.transport = this;
+	writer.capacity = reserved - stampLength;
+	writer.stampLength = stampLength;
+	mapping.detach(); //The writer points into the mapping until commit or cancel
+	return writer;
+}
+
+bool SharedMemoryHandler::commitAsyncWriter(AsyncWriter& writer, const std::string* key) {
+	MappingUse mapping(*this, true); //Held since reserveAsyncRequest
+	if (getCapture().isActive())
+		getCapture().record(CaptureRecordKind::Async, writer.view(), key ? std::string_view(*key) : std::string_view(), writer.lane);
+	SharedMemoryData* pData = static_cast<SharedMemoryData*>(pMapView);
+	char* record = writer.buffer - writer.stampLength;
+	auto length = writer.stampLength + writer.length;
+	if (writer.stampLength)
+		writeMessageStamp(makeMessageStamp(writer.lane, writer.captureTime), record);
+	const auto compressed = compressAsyncRequest(std::string_view(record, length), pData->getTelemetry());
+	if (compressed.data() != record) { //Always shorter, fits where the original was
+		memcpy(record, compressed.data(), compressed.length());
+		length = static_cast<uint32_t>(compressed.length());
+	}
+	const auto reserved = writer.stampLength + writer.capacity;
+	if (!key) {
+		pData->commitAsyncRequest(writer.lane, writer.recordPosition, reserved, length);
+		return true;
+	}
+	//Publish under the lock, otherwise a concurrent commit for the same key could get replaced by this older one
+	std::unique_lock lock(keyedMessagesLock);
+	pData->commitAsyncRequest(writer.lane, writer.recordPosition, reserved, length);
+	parkedKeyedMessages.erase(*key);
+	hasParkedMessages = !parkedKeyedMessages.empty();
+	replaceKeyedRequest(*key, KeyedPosition{ writer.lane, writer.recordPosition });
 	return true;
 }
 
-bool SharedMemoryHandler::doSyncAndAsyncRequest(const std::string& syncRequest, std::string& answer, const std::string& asyncRequest) {
-	if (!isReady()) return false;
+void SharedMemoryHandler::cancelAsyncWriter(AsyncWriter& writer) {
+	MappingUse mapping(*this, true); //Held since reserveAsyncRequest
+	//The space is claimed already, publish it as skipped record so TeamSpeak doesn't wait for it forever
+	SharedMemoryData* pData = static_cast<SharedMemoryData*>(pMapView);
+	pData->commitAsyncRequest(writer.lane, writer.recordPosition, writer.stampLength + writer.capacity, 0, true);
+}
+
+void SharedMemoryHandler::flushParkedMessages() {
+	for (auto it = parkedKeyedMessages.begin(); it != parkedKeyedMessages.end();) {
+		auto key = it->first;
+		auto message = std::move(it->second);
+		it = parkedKeyedMessages.erase(it);
+		if (!addKeyedRequest(message.message, key, message.stamp)) {
+			parkedKeyedMessages.emplace(std::move(key), std::move(message));
+			return; //Still full
+		}
+	}
+	hasParkedMessages = false;
+}
+
+void SharedMemoryHandler::flushParkedMessagesIfAny() {
+	if (!hasParkedMessages.load(std::memory_order_relaxed)) return;
+	std::unique_lock lock(keyedMessagesLock);
+	flushParkedMessages();
+}
+
+bool SharedMemoryHandler::doSyncAndAsyncRequest(std::string_view syncRequest, std::string& answer, std::string_view asyncRequest) {
+	MappingUse mapping(*this);
+	if (!useMapping(mapping)) return false;
+	if (syncRequest.length() > SHAREDMEM_MAX_STRINGSIZE) {
+		doAsyncRequest(asyncRequest); //TeamSpeak drains every lane before it looks for completions, async still comes first
+		if (getCapture().isActive())
+			getCapture().record(CaptureRecordKind::Sync, syncRequest);
+		return doFragmentedSyncRequest(syncRequest, answer);
+	}
+	if (getCapture().isActive()) {
+		getCapture().record(CaptureRecordKind::Async, asyncRequest, {}, MessageLane::Bulk);
+		getCapture().record(CaptureRecordKind::Sync, syncRequest);
+	}
 	MutexLock lock(hMutex);
 	if (!lock.isLocked())
 		return false;
 	SharedMemoryData* pData = static_cast<SharedMemoryData*>(pMapView);
-	pData->addAsyncRequest(asyncRequest);
-	pData->setSyncRequest(syncRequest);
+	const auto message = compressAsyncRequest(stampAsyncRequest(asyncRequest, makeMessageStamp(MessageLane::Bulk)), pData->getTelemetry());
+	if (!pData->addAsyncRequest(message, MessageLane::Bulk))
+		pData->getTelemetry()->countAsyncDropped(MessageLane::Bulk);
+	auto sequence = pData->setSyncRequest(syncRequest);
 	lock.unlock();
-	SetEvent(hEventRequest);
-	auto waited = SignalObjectAndWait(hEventRequest, hEventResponse, PIPE_TIMEOUT, FALSE);
-	ResetEvent(hEventResponse);
-	if (waited != WAIT_OBJECT_0) {
+	if (!signalSyncRequestAndWait(sequence))
 		return false;
-	}
     //lock.lock();//No need to lock again. There won't be anyone else who could write a sync response. gameTime update racecondition is possible but who if we mix up some microseconds
     //if (!lock.isLocked())
     //	return false;
 	return pData->getSyncResponse(answer);
 }
 
+bool SharedMemoryHandler::signalSyncRequestAndWait(uint32_t sequence) {
+	SharedMemoryData* pData = static_cast<SharedMemoryData*>(pMapView);
+	if (!isCapabilityActive(TransportCapability::SyncResponseSequence)) {
+		//Old TeamSpeak plugin, the event is the only thing telling us the answer is there
+		const auto start = std::chrono::steady_clock::now();
+		auto waited = signalAndWait(hEventRequest, hEventResponse, PIPE_TIMEOUT);
+		resetEvent(hEventResponse);
+		if (waited)
+			pData->getTelemetry()->countSyncLatency(std::chrono::steady_clock::now() - start);
+		else
+			pData->getTelemetry()->syncTimeouts.fetch_add(1, std::memory_order_relaxed);
+		return waited;
+	}
+
+	constexpr std::chrono::nanoseconds maxSpin = 50us;
+	const auto start = std::chrono::steady_clock::now();
+	signalEvent(hEventRequest);
+
+	//Spinning only pays off if the answer usually arrives before a kernel wakeup would. If TeamSpeak got slow don't burn the core
+	const auto average = syncLatencyAverage.load(std::memory_order_relaxed);
+	const auto spinTime = average * 2 <= maxSpin ? average * 2 : 0ns;
+	bool answered = false;
+	auto now = start;
+	while (now - start < spinTime) {
+		if (pData->isSyncResponseReady(sequence)) {
+			answered = true;
+			break;
+		}
+		cpuRelax();
+		now = std::chrono::steady_clock::now();
+	}
+
+	const auto deadline = start + std::chrono::milliseconds(PIPE_TIMEOUT);
+	while (!answered) {
+		//Reset before checking, TeamSpeak publishes the sequence before signaling so we can't miss a wakeup
+		resetEvent(hEventResponse);
+		if (pData->isSyncResponseReady(sequence)) {
+			answered = true;
+			break;
+		}
+		now = std::chrono::steady_clock::now();
+		if (now >= deadline || isMappingDraining()) //The remap waits for us, TeamSpeak won't answer through this mapping anymore
+			break;
+		waitEvent(hEventResponse, (std::min)(static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count()) + 1, 10u));
+	}
+	if (!answered) {
+		pData->getTelemetry()->syncTimeouts.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	//The event is likely still signaled from this answer, the next request resets it before waiting
+	const auto latency = std::chrono::steady_clock::now() - start;
+	//Concurrent callers may lose an update, doesn't matter for an average
+	syncLatencyAverage.store(average + (std::chrono::duration_cast<std::chrono::nanoseconds>(latency) - average) / 8, std::memory_order_relaxed);
+	pData->getTelemetry()->countSyncLatency(latency);
+	return true;
+}
+
+bool SharedMemoryHandler::doFragmentedSyncRequest(std::string_view request, std::string& answer) {
+	//Doesn't fit into the sync request slot. Send it as pipelined request, the async arena fragments it, and wait for the answer
+	auto requestID = queuePipelinedRequest(request, nullptr, true, MessageLane::Realtime, {});
+	if (requestID == 0) return false;
+
+	TransportTelemetry* telemetry = static_cast<SharedMemoryData*>(pMapView)->getTelemetry();
+	const auto start = std::chrono::steady_clock::now();
+	auto deadline = start + std::chrono::milliseconds(PIPE_TIMEOUT);
+	while (true) {
+		{
+			std::unique_lock pendingLock(pendingRequestsLock);
+			drainCompletionArena();
+			auto found = std::find_if(receivedCompletions.begin(), receivedCompletions.end(), [requestID](const auto& completion) {
+				return completion.first == requestID;
+			});
+			if (found != receivedCompletions.end()) {
+				answer = std::move(found->second);
+				receivedCompletions.erase(found);
+				pendingRequests.erase(requestID);
+				telemetry->countSyncLatency(std::chrono::steady_clock::now() - start);
+				return true;
+			}
+			if (std::chrono::steady_clock::now() > deadline || isMappingDraining()) {
+				pendingRequests.erase(requestID);
+				telemetry->syncTimeouts.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+		}
+		//TeamSpeak signals the response event after writing a completion
+		waitEvent(hEventResponse, 10);
+		resetEvent(hEventResponse);
+	}
+}
+
+void SharedMemoryHandler::drainCompletionArena() {
+	SharedMemoryData* pData = static_cast<SharedMemoryData*>(pMapView);
+	uint32_t requestID;
+	std::string answer;
+	while (pData->popCompletion(requestID, answer))
+		receivedCompletions.emplace_back(requestID, std::move(answer));
+}
+
+uint32_t SharedMemoryHandler::doPipelinedRequest(std::string_view request, RequestCallback callback, MessageLane lane,
+	std::chrono::steady_clock::time_point captureTime) {
+	MappingUse mapping(*this);
+	if (!useMapping(mapping)) return 0;
+	return queuePipelinedRequest(request, std::move(callback), false, lane, captureTime);
+}
+
+uint32_t SharedMemoryHandler::queuePipelinedRequest(std::string_view request, RequestCallback callback, bool awaited, MessageLane lane,
+	std::chrono::steady_clock::time_point captureTime) {
+	if (!isCapabilityActive(TransportCapability::PipelinedRequests)) return 0; //TeamSpeak would take it for a normal message
+	if (!awaited && getCapture().isActive()) //Awaited ones are sync requests, already captured as such
+		getCapture().record(CaptureRecordKind::Pipelined, request, {}, lane);
+
+	std::unique_lock pendingLock(pendingRequestsLock);
+	if (pendingRequests.size() >= SHAREDMEM_MAX_PIPELINED_REQUESTS)
+		return 0;
+	auto requestID = takeRequestID();
+
+	std::string prefix;
+	if (isCapabilityActive(TransportCapability::MessageTimestamps)) { //Stamp goes around the "REQ"
+		prefix.resize(MESSAGE_STAMP_LENGTH);
+		writeMessageStamp(makeMessageStamp(lane, captureTime), prefix.data());
+	}
+	prefix += "REQ\t"sv;
+	prefix += std::to_string(requestID);
+	prefix += '\t';
+
+	SharedMemoryData* pData = static_cast<SharedMemoryData*>(pMapView);
+	const auto length = static_cast<uint32_t>(prefix.length() + request.length());
+	uint32_t recordPosition;
+	if (char* buffer = length <= SharedMemoryData::maxRecordSize(lane) ? pData->reserveAsyncRequest(lane, length, recordPosition) : nullptr) {
+		//Format straight into the arena
+		memcpy(buffer, prefix.data(), prefix.length());
+		memcpy(buffer + prefix.length(), request.data(), request.length());
+		pData->commitAsyncRequest(lane, recordPosition, length, length);
+	} else {
+		//Too big for one record, arena has to fragment it
+		const auto message = compressAsyncRequest(prefix.append(request), pData->getTelemetry());
+		lane = SharedMemoryData::fitLane(lane, message.length());
+		if (!pData->addAsyncRequest(message, lane)) {
+			pData->getTelemetry()->countAsyncDropped(lane);
+			return 0;
+		}
+	}
+	pData->getTelemetry()->pipelinedRequests.fetch_add(1, std::memory_order_relaxed);
+	pendingRequests.emplace(requestID, PendingRequest{ std::move(callback), std::chrono::steady_clock::now(), awaited });
+	pendingLock.unlock();
+
+	signalEvent(hEventRequest); //Wake TeamSpeak up, it might be waiting for a sync request
+	return requestID;
+}
+
+void SharedMemoryHandler::pollCompletions() {
+	if (checkSession())
+		resetSession();
+	MappingUse mapping(*this);
+	if (!mapping.acquire()) return;
+	flushParkedMessagesIfAny();
+	std::unique_lock pendingLock(pendingRequestsLock);
+	drainCompletionArena();
+	dispatchCompletions(pendingLock, static_cast<SharedMemoryData*>(pMapView)->getTelemetry());
+}
+
 bool SharedMemoryHandler::isConnected() {
-	if (!isReady()) return false;
+	MappingUse mapping(*this);
+	if (!useMapping(mapping)) return false;
 	MutexLock lock(hMutex);
 	if (!lock.isLocked())
 		return false;
@@ -145,138 +613,251 @@ bool SharedMemoryHandler::isConnected() {
 }
 
 bool SharedMemoryHandler::needsConfigRefresh() {
-	if (!isReady()) return false;
+	MappingUse mapping(*this);
+	if (!useMapping(mapping)) return false;
 	SharedMemoryData* pData = static_cast<SharedMemoryData*>(pMapView);
 	return pData->needConfigRefresh();
 }
 
-bool SharedMemoryHandler::createMemRegion() {
-	if (!hEventRequest) {
-		hEventRequest = OpenEventW(
-			SYNCHRONIZE | EVENT_MODIFY_STATE,
-			FALSE,
-			L"Local\\TFARSHAMEM_EVTREQ"
-		);
-		if (!hEventRequest) {
-			if (GetLastError() != ERROR_FILE_NOT_FOUND)
-				errorMessage = "TFAR ERR OpenEvt REQ " + GetLastErrorString();
-			return false;
-		}
-	}
-	if (!hEventResponse) {
-		hEventResponse = OpenEventW(
-			SYNCHRONIZE | EVENT_MODIFY_STATE,
-			FALSE,
-			L"Local\\TFARSHAMEM_EVTRESP"
-		);
-		if (!hEventResponse) {
-			if (GetLastError() != ERROR_FILE_NOT_FOUND)
-				errorMessage = "TFAR ERR OpenEvt RESP " + GetLastErrorString();
-			return false;
-		}
-	}
-	if (!hMutex) {
-		hMutex = OpenMutexW(
-			SYNCHRONIZE,
-			FALSE,
-			L"Local\\TFARSHAMEM_MTX"
-		);
-		if (!hMutex) {
-			if (GetLastError() != ERROR_FILE_NOT_FOUND)
-				errorMessage = "TFAR ERR OpenMtx " + GetLastErrorString();
-			return false;
+bool SharedMemoryHandler::isCapabilityActive(TransportCapability cap) {
+	MappingUse mapping(*this);
+	if (!useMapping(mapping)) return false;
+	negotiateCapabilities();
+	return (negotiatedCapabilities.load(std::memory_order_relaxed) & static_cast<uint32_t>(cap)) != 0;
+}
+
+uint32_t SharedMemoryHandler::getNegotiatedCapabilities() {
+	MappingUse mapping(*this);
+	if (!useMapping(mapping)) return 0;
+	negotiateCapabilities();
+	return negotiatedCapabilities.load(std::memory_order_relaxed);
+}
+
+void SharedMemoryHandler::negotiateCapabilities() {
+	SharedMemoryData* pData = static_cast<SharedMemoryData*>(pMapView);
+	const auto negotiated = pData->getConsumerCapabilities() & SHAREDMEM_PRODUCER_CAPABILITIES;
+	//Every handler of the process computes the same, doesn't matter who publishes it
+	if (negotiated == negotiatedCapabilities.load(std::memory_order_relaxed) && negotiated == pData->getNegotiatedCapabilities() &&
+		pData->getProducerCapabilities() == SHAREDMEM_PRODUCER_CAPABILITIES)
+		return;
+	negotiatedCapabilities.store(negotiated, std::memory_order_relaxed);
+	pData->setNegotiatedCapabilities(SHAREDMEM_PRODUCER_CAPABILITIES, negotiated);
+}
+
+bool SharedMemoryHandler::getTelemetry(TransportTelemetry& copy) {
+	MappingUse mapping(*this);
+	if (!useMapping(mapping)) return false;
+	static_cast<SharedMemoryData*>(pMapView)->getTelemetry()->copyTo(copy);
+	return true;
+}
+
+bool SharedMemoryHandler::getConsumerTelemetry(ConsumerTelemetry& copy) {
+	MappingUse mapping(*this);
+	if (!useMapping(mapping)) return false;
+	static_cast<SharedMemoryData*>(pMapView)->getConsumerTelemetry()->copyTo(copy);
+	return true;
+}
+
+bool SharedMemoryHandler::isReady() {
+	//A handler nobody polls, like transactMessage's, would otherwise stay on the mapping of a TeamSpeak that restarted.
+	//A new session is still left for pollCompletions to handle
+	const auto now = std::chrono::steady_clock::now();
+	auto nextCheck = nextSessionCheck.load(std::memory_order_relaxed);
+	if (now >= nextCheck && nextSessionCheck.compare_exchange_strong(nextCheck, now + sessionCheckInterval, std::memory_order_relaxed))
+		refreshSession();
+	MappingUse mapping(*this);
+	return useMapping(mapping);
+}
+
+bool SharedMemoryHandler::useMapping(MappingUse& mapping) {
+	return mapping.acquire() || (connect() && mapping.acquire());
+}
+
+bool SharedMemoryHandler::lockMapping() {
+	auto users = mappingUsers.load(std::memory_order_relaxed);
+	do {
+		if (users != 0 && users != mappingDraining) return false;
+	} while (!mappingUsers.compare_exchange_weak(users, -1, std::memory_order_acquire, std::memory_order_relaxed));
+	return true;
+}
+
+void SharedMemoryHandler::drainMapping() {
+	mappingUsers.fetch_or(mappingDraining, std::memory_order_relaxed);
+}
+
+void SharedMemoryHandler::undrainMapping() {
+	auto users = mappingUsers.load(std::memory_order_relaxed);
+	do {
+		if (users < 0 || !(users & mappingDraining)) return; //Someone else got the lock, unlockMapping clears it
+	} while (!mappingUsers.compare_exchange_weak(users, users & ~mappingDraining, std::memory_order_relaxed));
+}
+
+bool SharedMemoryHandler::isMappingDraining() const {
+	return (mappingUsers.load(std::memory_order_relaxed) & mappingDraining) != 0;
+}
+
+void SharedMemoryHandler::unlockMapping() {
+	mappingUsers.store(0, std::memory_order_release);
+}
+
+bool SharedMemoryHandler::connect() {
+	//Never waits for the lock, this thread may be one of the users with an open AsyncWriter. A pending remap is up to checkSession
+	if (isMappingDraining() || !lockMapping()) return false;
+	const auto connected = pMapView || mapRegion(std::chrono::steady_clock::now());
+	unlockMapping();
+	return connected;
+}
+
+bool SharedMemoryHandler::mapRegion(std::chrono::steady_clock::time_point now) {
+	//Don't hammer OpenFileMapping/MapViewOfFile on every call while TeamSpeak isn't there
+	if (now < nextConnectAttempt) return false;
+	auto connected = createMemMap();
+	if (connected) {
+		SharedMemoryData* pData = static_cast<SharedMemoryData*>(pMapView);
+		if (pData->getLayoutVersion() != SHAREDMEM_LAYOUT_VERSION) {
+			//Could also be a TeamSpeak that is just creating it, we try again later
+			errorMessage = "TFAR ERR Shared memory layout " + std::to_string(pData->getLayoutVersion()) +
+				", expected " + std::to_string(SHAREDMEM_LAYOUT_VERSION) + ". Update the TeamSpeak plugin";
+			releaseMemMap();
+			connected = false;
 		}
 	}
-
-	if (hMapFile)
-		CloseHandle(hMapFile);
-	hMapFile = OpenFileMappingW(
-		FILE_MAP_WRITE,    // read/write access
-		FALSE,                  // do not inherit the name
-		L"Local\\TFARSHAMEM");             // name of mapping object
-	if (!hMapFile) {
-		if (GetLastError() != ERROR_FILE_NOT_FOUND)
-			errorMessage = "TFAR ERR OpenFMap " + GetLastErrorString();
+	if (!connected) {
+		nextConnectAttempt = now + reconnectBackoff;
+		reconnectBackoff = (std::min)(reconnectBackoff * 2, maxReconnectBackoff);
 		return false;
 	}
+
+	errorMessage.clear();
+	reconnectBackoff = minReconnectBackoff;
+	TransportTelemetry* telemetry = static_cast<SharedMemoryData*>(pMapView)->getTelemetry();
+	telemetry->mappingMode.store(mappedMode, std::memory_order_relaxed);
+	telemetry->mappingFaults.store(mappingFaults, std::memory_order_relaxed);
+	negotiateCapabilities();
+	const auto generation = static_cast<SharedMemoryData*>(pMapView)->getSessionGeneration();
+	if (sessionGeneration == 0) //First connect, nothing to resend
+		sessionGeneration = generation;
+	else if (generation != sessionGeneration)
+		markSessionChanged(generation);
 	return true;
 }
 
-bool SharedMemoryHandler::createMemMap() {
-	if (!hMapFile) {
-		if (!createMemRegion())
-			return false;
+void SharedMemoryHandler::markSessionChanged(uint32_t generation) {
+	sessionGeneration = generation;
+	{
+		std::unique_lock lock(keyedMessagesLock);
+		keyedMessagePositions.clear(); //Positions in the old arena. Parked messages are the newest state, they go to the new one
 	}
-	if (pMapView)
-		CloseHandle(pMapView);
+	sessionChanged = true;
+}
 
-	pMapView = MapViewOfFile(hMapFile,   // handle to map object
-		FILE_MAP_WRITE, // read/write permission
-		0,
-		0,
-		SHAREDMEM_BUFSIZE);
+void SharedMemoryHandler::refreshSession() {
+	//TeamSpeak stopped ticking. It may have created a new region under the same name that our old mapping doesn't see,
+	//so reopen it. If it's really the same one, back off so a hanging TeamSpeak doesn't cause remapping on every tick
+	const auto now = std::chrono::steady_clock::now();
+	auto isCurrent = [this, now]() {
+		SharedMemoryData* pData = static_cast<SharedMemoryData*>(pMapView);
+		return pData->getSessionGeneration() == sessionGeneration && (now < nextConnectAttempt ||
+			(!isMemMapOrphaned() && std::chrono::system_clock::now() - pData->getLastPluginTick() < std::chrono::milliseconds(PIPE_TIMEOUT)));
+	};
+	{
+		MappingUse mapping(*this);
+		if (mapping.acquire() && isCurrent())
+			return;
+	}
+	//Replacing the mapping needs everyone else off it, new calls fail meanwhile. Sync waits give up when they see that
+	drainMapping();
+	const auto drainDeadline = now + maxDrainWait;
+	while (!lockMapping()) {
+		if (std::chrono::steady_clock::now() >= drainDeadline) {
+			undrainMapping(); //Still in use, e.g. an open AsyncWriter. The next check tries again
+			return;
+		}
+		std::this_thread::sleep_for(1ms);
+	}
 	if (!pMapView) {
-		if (GetLastError() != ERROR_FILE_NOT_FOUND)
-			errorMessage = "TFAR ERR MapFile " + GetLastErrorString();
-		if (hMapFile) {
-			CloseHandle(hMapFile);
-			hMapFile = nullptr;
+		mapRegion(now);
+	} else if (!isCurrent()) {
+		SharedMemoryData* pData = static_cast<SharedMemoryData*>(pMapView);
+		if (pData->getSessionGeneration() != sessionGeneration) { //TeamSpeak reinitialized the region we are mapped to
+			markSessionChanged(pData->getSessionGeneration());
+		} else {
+			const auto oldGeneration = sessionGeneration;
+			releaseMemMap();
+			if (mapRegion(now) && sessionGeneration == oldGeneration) {
+				nextConnectAttempt = now + reconnectBackoff;
+				reconnectBackoff = (std::min)(reconnectBackoff * 2, maxReconnectBackoff);
+			}
 		}
-		return false;
 	}
+	unlockMapping();
+}
 
-	return true;
+bool SharedMemoryHandler::checkSession() {
+	refreshSession();
+	return sessionChanged.exchange(false);
 }
 
-bool SharedMemoryHandler::isReady() {
-	if (!pMapView) {
-		if (!createMemMap())
-			return false;
-	}
-	return true;
+void SharedMemoryHandler::resetSession() {
+	syncLatencyAverage.store(20us, std::memory_order_relaxed);
+	failPendingRequests(); //doFragmentedSyncRequest times out on its own
+	onNewSession();
 }
 
-void SharedMemoryHandler::shutdown() const {
-	if (pMapView) {
+void SharedMemoryHandler::shutdown() {
+	MappingUse mapping(*this);
+	if (mapping.acquire()) {
 		SharedMemoryData* pData = static_cast<SharedMemoryData*>(pMapView);
 		pData->onShutdown();
 	}
 }
 
-SharedMemoryTransfer::SharedMemoryTransfer() {}
+SharedMemoryTransfer::SharedMemoryTransfer() : handler(Transport::createFromEnvironment()) {}
 
 
 SharedMemoryTransfer::~SharedMemoryTransfer() {}
 
+static void copyToOutput(char* output, int outputSize, std::string_view text) {
+	if (outputSize <= 0) return;
+	auto length = (std::min)(text.length(), static_cast<size_t>(outputSize - 1));
+	memcpy(output, text.data(), length);
+	output[length] = 0;
+}
+
 void SharedMemoryTransfer::transactMessage(char* output, int outputSize, const char* input) {
-	std::string answer;
-	std::string inp(input);
-	if (!handler.isReady()) {
-		if (handler.errorMessage.empty())
-			strncpy_s(output, outputSize, "Not connected to TeamSpeak", _TRUNCATE);
+	//Called every frame by SQF, neither the request nor the answer is copied into a std::string
+	const std::string_view request(input);
+	if (!handler->isReady()) {
+		if (handler->errorMessage.empty())
+			copyToOutput(output, outputSize, "Not connected to TeamSpeak");
 		else
-			strncpy_s(output, outputSize, handler.errorMessage.c_str(), min(handler.errorMessage.length(), outputSize - 1));
-		handler.errorMessage = "";
+			copyToOutput(output, outputSize, handler->errorMessage);
+		handler->errorMessage = "";
 		return;
 	}
 
-	if (!handler.isConnected()) {
+	if (!handler->isConnected()) {
 		printf("not connected\n");
-		strncpy_s(output, outputSize, "Not connected to TeamSpeak", _TRUNCATE);
+		copyToOutput(output, outputSize, "Not connected to TeamSpeak");
 		return;
 	}
 
-	if (inp.back() == '~') {
-		handler.doAsyncRequest(inp);
-		if (inp.front() == 'D' && handler.needsConfigRefresh())//DFRAME
-			answer = "NEEDCFG";
-		else if (inp.front() == 'M')//MISSIONEND
-			handler.shutdown();
-		else
-			answer = "OK";
-	} else {
-		handler.doSyncRequest(inp, answer);
+	if (request.empty()) {
+		copyToOutput(output, outputSize, ""sv);
+		return;
 	}
 
-	strncpy_s(output, outputSize, answer.c_str(), min(answer.length(), outputSize - 1));
+	if (request.back() == '~') {
+		std::string_view answer;
+		handler->doAsyncRequest(request, MessageLane::Control);
+		if (request.front() == 'D' && handler->needsConfigRefresh())//DFRAME
+			answer = "NEEDCFG"sv;
+		else if (request.front() == 'M')//MISSIONEND
+			handler->shutdown();
+		else
+			answer = "OK"sv;
+		copyToOutput(output, outputSize, answer);
+	} else if (!handler->doSyncRequest(request, output, static_cast<size_t>((std::max)(outputSize, 0)))) {
+		copyToOutput(output, outputSize, ""sv);
+	}
 }
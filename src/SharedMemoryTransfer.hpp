@@ -1,39 +1,147 @@
 #pragma once
+#ifdef _WIN32
 #include <Windows.h>
+#else
+#include "SharedMemoryPosix.hpp"
+#endif
+#include <algorithm>
+#include <atomic>
 #include <chrono>
-
-using namespace std::chrono_literals;
-
-#define PIPE_NAME L"\\\\.\\pipe\\task_force_radio_pipe"
-#define DEBUG_PIPE_NAME L"\\\\.\\pipe\\task_force_radio_pipe_debug"
-#define DEBUG_PARAMETER L"-tfdebug"
-#define PIPE_TIMEOUT 1000
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "MessageArena.hpp"
+#include "Transport.hpp"
 
 /*
 Shared Mem layout
-offset 0: SharedMemoryData
-offset 128: Synchronous Request [512b]
-offset 640: Synchronous Answer [512b]
-offset 1152: Asynchronous Messages array of SharedMemString[500]
+offset 0: SharedMemoryData [SHAREDMEM_HEADER_SIZE]
+offset 256: Synchronous Request [2048b]
+offset 2304: Synchronous Answer [2048b]
+offset 4352: Control lane async messages MessageArena<SHAREDMEM_CONTROLARENA_SIZE>
+offset SHAREDMEM_REALTIMEARENA_OFFSET: Realtime lane async messages MessageArena<SHAREDMEM_REALTIMEARENA_SIZE>
+offset SHAREDMEM_ASYNCARENA_OFFSET: Bulk lane async messages MessageArena<SHAREDMEM_ASYNCARENA_SIZE>
+offset SHAREDMEM_COMPLETIONARENA_OFFSET: Pipelined request completions MessageArena<SHAREDMEM_COMPLETIONARENA_SIZE>
+offset SHAREDMEM_TELEMETRY_OFFSET: TransportTelemetry, counters only the game writes
+offset SHAREDMEM_CONSUMERTELEMETRY_OFFSET: ConsumerTelemetry, data age only TeamSpeak writes
+
+SharedMemoryData keeps fields written by the game and fields written by TeamSpeak on separate cache lines,
+so updating lastGameTick doesn't invalidate the line TeamSpeak is polling and the other way around.
+layoutVersion is written by TeamSpeak when it creates the region, the game refuses to use a region with a different layout.
+sessionGeneration is a new non zero value every time TeamSpeak (re)creates or reinitializes the region. When the game sees it
+change, or TeamSpeak stopped ticking and reopening the region by name yields a different one, everything it sent before is gone.
+It drops its local state about the old session and resends full state, see SharedMemoryHandler::onNewSession.
+
+Every async lane is a multi-producer/single-consumer byte ring of length prefixed records, see MessageArena.hpp.
+Every thread of the game may push without locking, TeamSpeak only ever writes its tail. Neither side needs hMutex for it.
+Each MessageLane has its own ring, so a full Bulk lane doesn't hold back Control or Realtime messages. TeamSpeak takes the next
+message from the first non empty lane in the order Control, Realtime, Bulk, a realtime message waits for at most one bulk message.
+Order is only kept within a lane. Messages too big for their lane's arena go to the Bulk lane.
+
+Pipelined requests are async records "REQ\t<id>\t<request>", in the Realtime lane unless the caller picks another one. TeamSpeak answers them by writing "<id>\t<answer>"
+into the completion arena, there it is the producer and the game is the consumer.
+Any number of them can be outstanding, the game matches answers to requests by id.
+TeamSpeak signals the response event after writing a completion.
+
+Every sync request increments syncRequestSequence. A TeamSpeak with TransportCapability::SyncResponseSequence copies it
+into syncResponseSequence after writing the answer, and still signals the response event. The game spins on that word for
+about as long as answers took recently, and only then falls back to waiting on the event.
+
+Sync requests bigger than SHAREDMEM_MAX_STRINGSIZE don't fit the sync slot. They are sent as pipelined request instead,
+the async arena fragments them transparently, and the caller waits for the completion.
+
+Async messages of at least SHAREDMEM_COMPRESSION_THRESHOLD bytes are sent as "CMP\t<original length>\t<LZ block>"
+if TransportCapability::CompressedMessages is negotiated and it saves enough, see MessageCompression.hpp.
+TeamSpeak decompresses and handles the result like any other record, that may again be a "REQ" or a keyed message.
+
+With TransportCapability::MessageTimestamps every async record starts with a "TS" stamp, see MessageStamp.hpp.
+TeamSpeak strips it and adds how old the data was when it got consumed to ConsumerTelemetry.
+
+The game maps the region with MemMapMode::Prefault unless TFAR_SHAREDMEM_MAPPING says otherwise, so the worker's first
+message into a lane after mission start doesn't take page faults. MemMapMode::Lock also keeps it resident. Both are best
+effort, TransportTelemetry::mappingMode tells what the mapping got and mappingFaults what it cost.
+
+Optional protocol features are negotiated instead of bumping the layout version, so mixed versions keep working from
+layout 9 on. Older TeamSpeak plugins use an incompatible layout and are refused, they have to be updated.
+TeamSpeak announces what it understands in consumerCapabilities, the game what it can produce in producerCapabilities.
+On connect, and whenever consumerCapabilities changes, the game publishes the intersection in negotiatedCapabilities
+and only uses those features from then on. TeamSpeak can read it to know what to expect.
+SHAREDMEM_LAYOUT_VERSION only changes when offsets move, then both sides have to be updated.
 */
 
-#define SHAREDMEM_ASYNCMSG_COUNT 300
+#define SHAREDMEM_CONTROLARENA_SIZE (16 * 1024) //Has to be power of two
+#define SHAREDMEM_REALTIMEARENA_SIZE (64 * 1024) //Has to be power of two
+#define SHAREDMEM_ASYNCARENA_SIZE (256 * 1024) //Bulk lane, has to be power of two
+#define SHAREDMEM_COMPLETIONARENA_SIZE (64 * 1024) //Has to be power of two
 #define SHAREDMEM_MAX_STRINGSIZE sizeof(SharedMemString) -4
-#define SHAREDMEM_BUFSIZE 128+sizeof(SharedMemString)+sizeof(SharedMemString)+(sizeof(SharedMemString) * SHAREDMEM_ASYNCMSG_COUNT) //Header+SyncReq+SyncAnsw+AsyncMessages
+#define SHAREDMEM_MAX_ASYNCSIZE SharedMemoryHandlerInternal::AsyncMessageArena::maxMessageSize
+#define SHAREDMEM_LAYOUT_VERSION 9 //Bump on every change to the layout above
+#define SHAREDMEM_HEADER_SIZE 256
+#define SHAREDMEM_SYNCREQUEST_OFFSET SHAREDMEM_HEADER_SIZE
+#define SHAREDMEM_SYNCANSWER_OFFSET (SHAREDMEM_SYNCREQUEST_OFFSET + sizeof(SharedMemString))
+#define SHAREDMEM_CONTROLARENA_OFFSET (SHAREDMEM_SYNCANSWER_OFFSET + sizeof(SharedMemString))
+#define SHAREDMEM_REALTIMEARENA_OFFSET (SHAREDMEM_CONTROLARENA_OFFSET + sizeof(SharedMemoryHandlerInternal::ControlArena))
+#define SHAREDMEM_ASYNCARENA_OFFSET (SHAREDMEM_REALTIMEARENA_OFFSET + sizeof(SharedMemoryHandlerInternal::RealtimeArena))
+#define SHAREDMEM_COMPLETIONARENA_OFFSET (SHAREDMEM_ASYNCARENA_OFFSET + sizeof(SharedMemoryHandlerInternal::AsyncMessageArena))
+#define SHAREDMEM_TELEMETRY_OFFSET (SHAREDMEM_COMPLETIONARENA_OFFSET + sizeof(SharedMemoryHandlerInternal::CompletionArena))
+#define SHAREDMEM_CONSUMERTELEMETRY_OFFSET ((SHAREDMEM_TELEMETRY_OFFSET + sizeof(TransportTelemetry) + 63) & ~size_t(63)) //Own cache line
+#define SHAREDMEM_BUFSIZE SHAREDMEM_CONSUMERTELEMETRY_OFFSET + sizeof(ConsumerTelemetry) //Header+SyncReq+SyncAnsw+Lanes+Completions+Telemetry
 #include <chrono>
 #include <string>
 
+//Everything this build of the game plugin can produce
+constexpr uint32_t SHAREDMEM_PRODUCER_CAPABILITIES =
+	static_cast<uint32_t>(TransportCapability::BinaryPositions) |
+	static_cast<uint32_t>(TransportCapability::PositionDeltas) |
+	static_cast<uint32_t>(TransportCapability::SyncResponseSequence) |
+	static_cast<uint32_t>(TransportCapability::PipelinedRequests) |
+	static_cast<uint32_t>(TransportCapability::CompressedMessages) |
+	static_cast<uint32_t>(TransportCapability::MessageTimestamps) |
+	static_cast<uint32_t>(TransportCapability::PositionBatches);
+
+//How the game maps the region, TFAR_SHAREDMEM_MAPPING is "lazy", "prefault" or "lock"
+enum class MemMapMode : uint32_t {
+	Prefault = 1 << 0, //Fault every page in when connecting instead of on first use
+	Lock = 1 << 1 //Keep it resident, implies Prefault
+};
+constexpr uint32_t SHAREDMEM_DEFAULT_MAPPING = static_cast<uint32_t>(MemMapMode::Prefault);
+
 namespace SharedMemoryHandlerInternal {
+#ifdef _WIN32
+	using EventHandle = HANDLE;
+	using MutexHandle = HANDLE;
+#else
+	using EventHandle = FutexEvent*;
+	using MutexHandle = FutexMutex*;
+#endif
+	//Platform primitives, implemented in SharedMemoryTransferWin32.cpp and SharedMemoryTransferPosix.cpp
+	bool lockNamedMutex(MutexHandle mutex, uint32_t timeoutMs);
+	void unlockNamedMutex(MutexHandle mutex);
+	void signalEvent(EventHandle evt);
+	void resetEvent(EventHandle evt);
+	bool signalAndWait(EventHandle toSignal, EventHandle toWait, uint32_t timeoutMs); //false on timeout
+	bool waitEvent(EventHandle evt, uint32_t timeoutMs); //false on timeout
+	void reportTooBigRequest(std::string_view req, const char* title);
+	void cpuRelax(); //Spin loop hint
+	uint64_t processPageFaults(); //Of the whole process so far, minor and major
+	void prefaultPages(const void* view, size_t size); //Reads one byte per page
+	bool parseMemMapMode(std::string_view name, uint32_t& mode); //MemMapMode bits of a TFAR_SHAREDMEM_MAPPING value
+
+	using ControlArena = MessageArena<SHAREDMEM_CONTROLARENA_SIZE>;
+	using RealtimeArena = MessageArena<SHAREDMEM_REALTIMEARENA_SIZE>;
+	using AsyncMessageArena = MessageArena<SHAREDMEM_ASYNCARENA_SIZE>; //Bulk lane
+	using CompletionArena = MessageArena<SHAREDMEM_COMPLETIONARENA_SIZE>;
+
 	struct SharedMemString {
 		uint32_t length{ 0 };
 		char data[2044]{ 0 };
-		SharedMemString& operator=(const std::string& other) {
+		SharedMemString& operator=(std::string_view other) {
 			length = static_cast<uint32_t>(other.length());
 			if (length == 0 || length > SHAREDMEM_MAX_STRINGSIZE) {
 				length = 0;
 				return *this;
 			}
-			memcpy(data, other.c_str(), length);
+			memcpy(data, other.data(), length);
 			return *this;
 		}
 		bool assignTo(std::string& other) const {
@@ -51,81 +159,240 @@ namespace SharedMemoryHandlerInternal {
 			length = 0;
 			return true;
 		}
+		//Truncates to outputSize - 1 and null terminates, like callExtension expects
+		bool assignToAndClear(char* output, size_t outputSize) {
+			if (length == 0 || length > SHAREDMEM_MAX_STRINGSIZE)
+				return false;
+			if (outputSize > 0) {
+				const auto copied = (std::min)(static_cast<size_t>(length), outputSize - 1);
+				memcpy(output, data, copied);
+				output[copied] = 0;
+			}
+			length = 0;
+			return true;
+		}
 	};
 	class SharedMemoryData {
 	public:
-		explicit SharedMemoryData(uint32_t _size) :sharedMemSize(_size) {}
-		bool canAddAsyncRequest() const;
-		void addAsyncRequest(const std::string& req);
-		void setSyncRequest(const std::string& req);
+		SharedMemoryData(uint32_t _size, uint32_t _sessionGeneration) : //Consumer side
+			layoutVersion(SHAREDMEM_LAYOUT_VERSION), sharedMemSize(_size), sessionGeneration(_sessionGeneration) {}
+		uint32_t getLayoutVersion() const { return layoutVersion; }
+		uint32_t getSessionGeneration() const { return sessionGeneration; }
+		//The lane a message of length goes to, Bulk if it's too big for the arena of lane
+		static MessageLane fitLane(MessageLane lane, size_t length);
+		static uint32_t maxRecordSize(MessageLane lane);
+		bool canAddAsyncRequest(MessageLane lane) const;
+		bool addAsyncRequest(std::string_view req, MessageLane lane, uint32_t* recordPosition = nullptr);
+		bool skipAsyncRequest(MessageLane lane, uint32_t recordPosition); //Replace a not yet consumed message
+		char* reserveAsyncRequest(MessageLane lane, uint32_t maxLength, uint32_t& recordPosition);
+		void commitAsyncRequest(MessageLane lane, uint32_t recordPosition, uint32_t maxLength, uint32_t length, bool skipped = false);
+		bool popAsyncRequest(std::string& req); //Consumer side, Control first, then Realtime, then Bulk
+		bool addCompletion(uint32_t requestID, const std::string& answer); //Consumer side
+		bool popCompletion(uint32_t& requestID, std::string& answer);
+		uint32_t setSyncRequest(std::string_view req); //Returns the sequence number the answer will carry
 		bool getSyncResponse(std::string& response);
+		bool getSyncResponse(char* output, size_t outputSize); //See SharedMemString::assignToAndClear
+		bool isSyncResponseReady(uint32_t sequence) const {
+			return syncResponseSequence.load(std::memory_order_acquire) == sequence;
+		}
+		bool getSyncRequest(std::string& request); //Consumer side
+		void setSyncResponse(const std::string& answer); //Consumer side
 		bool hasAsyncRequest() const;
 		bool hasSyncRequest() const;
 		std::chrono::system_clock::time_point getLastGameTick() const { return lastGameTick; }
 		void setLastGameTick() { lastGameTick = std::chrono::system_clock::now(); }
 		std::chrono::system_clock::time_point getLastPluginTick() const { return lastPluginTick; }
+		void setLastPluginTick() { lastPluginTick = std::chrono::system_clock::now(); } //Consumer side
 		void onShutdown() {
-			lastGameTick = std::chrono::system_clock::time_point(0us); 
-			nextFreeAsyncMessage = 0;
+			lastGameTick = std::chrono::system_clock::time_point(0us);
+			//Ring indices stay untouched, the consumer drains whatever is left
 		}
 		bool needConfigRefresh() const { return configNeedsRefresh; }
+		uint32_t getConsumerCapabilities() const { return consumerCapabilities.load(std::memory_order_relaxed); }
+		void setConsumerCapabilities(uint32_t caps) { consumerCapabilities.store(caps, std::memory_order_relaxed); } //Consumer side
+		uint32_t getProducerCapabilities() const { return producerCapabilities.load(std::memory_order_relaxed); }
+		uint32_t getNegotiatedCapabilities() const { return negotiatedCapabilities.load(std::memory_order_acquire); }
+		void setNegotiatedCapabilities(uint32_t producer, uint32_t negotiated) {
+			producerCapabilities.store(producer, std::memory_order_relaxed);
+			negotiatedCapabilities.store(negotiated, std::memory_order_release);
+		}
+		TransportTelemetry* getTelemetry();
+		ConsumerTelemetry* getConsumerTelemetry(); //Written by the consumer
 	private:
+		//Calls func with the arena of lane, the arena types differ in capacity
+		template <typename Func>
+		decltype(auto) withLaneArena(MessageLane lane, Func&& func);
+		template <typename Func>
+		decltype(auto) withLaneArena(MessageLane lane, Func&& func) const;
+		CompletionArena* getCompletionArena();
+		//Written once when TeamSpeak creates the region
+		uint32_t layoutVersion{ 0 };
 		uint32_t sharedMemSize{ 0 };
-		volatile uint16_t nextFreeAsyncMessage{ 0 };
-		std::chrono::system_clock::time_point lastGameTick;
-		std::chrono::system_clock::time_point lastPluginTick;
+		uint32_t sessionGeneration{ 0 };
+
+		//Only written by the game
+		alignas(64) std::chrono::system_clock::time_point lastGameTick;
+		std::atomic<uint32_t> syncRequestSequence{ 0 };
+		std::atomic<uint32_t> producerCapabilities{ 0 }; //TransportCapability bits
+		std::atomic<uint32_t> negotiatedCapabilities{ 0 }; //producerCapabilities & consumerCapabilities
+
+		//Only written by TeamSpeak
+		alignas(64) std::chrono::system_clock::time_point lastPluginTick;
 		volatile bool configNeedsRefresh;  //no mutex
+		std::atomic<uint32_t> consumerCapabilities{ 0 }; //TransportCapability bits
+		std::atomic<uint32_t> syncResponseSequence{ 0 };
 	};
-	static_assert(sizeof(SharedMemoryData) < 128, "SharedMemoryData is bigger than space allocated to it in SHAMEM");
+	static_assert(std::atomic<uint32_t>::is_always_lock_free, "Shared ring indices need to be lock free to work across processes");
+	static_assert(std::atomic<uint64_t>::is_always_lock_free, "Telemetry counters need to be lock free to work across processes");
+	static_assert(sizeof(SharedMemoryData) <= SHAREDMEM_HEADER_SIZE, "SharedMemoryData is bigger than space allocated to it in SHAMEM");
+	static_assert(SHAREDMEM_CONTROLARENA_OFFSET % 64 == 0 && SHAREDMEM_REALTIMEARENA_OFFSET % 64 == 0 && SHAREDMEM_ASYNCARENA_OFFSET % 64 == 0,
+		"Arena indices have to start on their own cache line");
 	class MutexLock {
-		HANDLE hMutex;
+		MutexHandle hMutex;
 		bool m_isLocked = false;
 	public:
-		explicit MutexLock(HANDLE _mutex) : hMutex(_mutex) { lock(); }
+		explicit MutexLock(MutexHandle _mutex) : hMutex(_mutex) { lock(); }
 		~MutexLock() {
 			unlock();
 		}
 		bool isLocked() const { return m_isLocked; }
 		void unlock() {
 			if (!m_isLocked) return;
-			ReleaseMutex(hMutex);
+			unlockNamedMutex(hMutex);
 			m_isLocked = false;
 		}
 		void lock() {
 			if (m_isLocked) return;
-			DWORD dwWaitResult = WaitForSingleObject(
-				hMutex,    // handle to mutex
-				500);  // no time-out interval
-			if (dwWaitResult == WAIT_OBJECT_0) {
-				m_isLocked = true;
-				return;
-			}
-			m_isLocked = false;
+			m_isLocked = lockNamedMutex(hMutex, 500);
 		};
 	};
 }
 
-class SharedMemoryHandler {
+class SharedMemoryHandler : public Transport {
 public:
-	SharedMemoryHandler();
-	~SharedMemoryHandler();
-	bool canDoAsyncRequest() const;
-	bool doSyncRequest(const std::string& request, std::string& answer);
-	bool doAsyncRequest(const std::string& request);
-	bool doSyncAndAsyncRequest(const std::string& syncRequest, std::string& answer, const std::string& asyncRequest);
-	bool isConnected();
-	bool needsConfigRefresh();
-	bool isReady();
-	void shutdown() const;
-	std::string errorMessage;
+	explicit SharedMemoryHandler(uint32_t mappingMode = SHAREDMEM_DEFAULT_MAPPING); //MemMapMode bits
+	~SharedMemoryHandler() override;
+	bool canDoAsyncRequest(MessageLane lane = MessageLane::Bulk) const override;
+	bool doSyncRequest(std::string_view request, std::string& answer) override;
+	//Writes the answer straight from shared memory into output. No heap allocation unless the request is too big for the sync slot
+	bool doSyncRequest(std::string_view request, char* output, size_t outputSize) override;
+	//Every lane is its own arena, see the layout above
+	bool doAsyncRequest(std::string_view request, MessageLane lane = MessageLane::Bulk, std::chrono::steady_clock::time_point captureTime = {}) override;
+	bool doAsyncRequest(std::string_view request, const std::string& key, MessageLane lane = MessageLane::Bulk,
+		std::chrono::steady_clock::time_point captureTime = {}) override;
+	//The stamp is written in front of the writer's buffer on commit
+	AsyncWriter reserveAsyncRequest(uint32_t maxLength, MessageLane lane = MessageLane::Bulk, std::chrono::steady_clock::time_point captureTime = {}) override;
+	bool doSyncAndAsyncRequest(std::string_view syncRequest, std::string& answer, std::string_view asyncRequest) override;
+	using Transport::doPipelinedRequest;
+	uint32_t doPipelinedRequest(std::string_view request, RequestCallback callback, MessageLane lane = MessageLane::Realtime,
+		std::chrono::steady_clock::time_point captureTime = {}) override;
+	//Drains the completion arena, also notices when TeamSpeak recreated the region
+	void pollCompletions() override;
+	bool isConnected() override;
+	bool needsConfigRefresh() override;
+	bool isCapabilityActive(TransportCapability cap) override;
+	uint32_t getNegotiatedCapabilities() override;
+	bool getTelemetry(SharedMemoryHandlerInternal::TransportTelemetry& copy) override;
+	bool getConsumerTelemetry(SharedMemoryHandlerInternal::ConsumerTelemetry& copy) override;
+	bool isReady() override; //After a failed attempt it waits reconnectBackoff before trying again. Also remaps a dead session
+	void shutdown() override;
+protected:
+	bool commitAsyncWriter(AsyncWriter& writer, const std::string* key) override;
+	void cancelAsyncWriter(AsyncWriter& writer) override;
 private:
+	//Keeps pMapView mapped while held. Never waits, acquire fails while the mapping is being replaced or there is none
+	class MappingUse {
+	public:
+		explicit MappingUse(const SharedMemoryHandler& _handler, bool adopt = false) : handler(_handler), held(adopt) {}
+		MappingUse(const MappingUse&) = delete;
+		MappingUse& operator=(const MappingUse&) = delete;
+		~MappingUse() { release(); }
+		bool acquire();
+		void release();
+		void detach() { held = false; } //An open AsyncWriter keeps it, commit or cancel adopts it again
+	private:
+		const SharedMemoryHandler& handler;
+		bool held;
+	};
+	bool useMapping(MappingUse& mapping); //Connects first if there is no mapping
+	bool connect(); //Only if nobody uses the mapping, true if mapped afterwards
+	bool lockMapping(); //Exclusive, fails if anyone uses it
+	void unlockMapping();
+	void drainMapping(); //New uses fail until the next lockMapping got it, so busy callers can't hold a remap off forever
+	void undrainMapping(); //Gave up waiting for the lock
+	bool isMappingDraining() const; //Long waits give up, the remap is waiting for them
+	bool mapRegion(std::chrono::steady_clock::time_point now); //Needs lockMapping
+	void markSessionChanged(uint32_t generation); //Needs lockMapping
+	void refreshSession(); //Remaps if TeamSpeak went away, must not hold a MappingUse
+	bool checkSession(); //True if TeamSpeak started a new session since the last call
+	void resetSession();
+	void negotiateCapabilities();
+	uint32_t queuePipelinedRequest(std::string_view request, RequestCallback callback, bool awaited, MessageLane lane,
+		std::chrono::steady_clock::time_point captureTime);
+	bool sendSyncRequest(std::string_view request); //Fits the sync slot, true once the answer is there
+	bool doFragmentedSyncRequest(std::string_view request, std::string& answer);
+	void drainCompletionArena(); //Needs pendingRequestsLock
+	bool signalSyncRequestAndWait(uint32_t sequence);
+	struct KeyedPosition {
+		MessageLane lane;
+		uint32_t recordPosition;
+	};
+	struct ParkedMessage {
+		std::string message;
+		SharedMemoryHandlerInternal::MessageStamp stamp; //Lane and times it was sent with
+	};
+	//Stamps and compresses request, position gets the lane it went to. false if that one is full
+	bool addAsyncMessage(std::string_view request, const SharedMemoryHandlerInternal::MessageStamp& stamp, KeyedPosition& position);
+	bool addKeyedRequest(std::string_view request, const std::string& key, const SharedMemoryHandlerInternal::MessageStamp& stamp); //Needs keyedMessagesLock
+	void replaceKeyedRequest(const std::string& key, KeyedPosition position); //Needs keyedMessagesLock
+	void flushParkedMessages(); //Needs keyedMessagesLock
+	void flushParkedMessagesIfAny();
+
+	//Platform specific
 	bool createMemRegion();
-	bool createMemMap();
+	bool createMemMap(); //Also prefaults and locks it as mappingMode asks
+	bool lockMemMap();
+	bool isMemMapOrphaned() const; //Region got removed by name, TeamSpeak will create a new one
+	void releaseMemMap();
+#ifdef _WIN32
 	HANDLE hMapFile = nullptr;
-	HANDLE hEventRequest = nullptr;
-	HANDLE hEventResponse = nullptr;
-	HANDLE hMutex = nullptr;
-	HANDLE pMapView = nullptr;
+#else
+	int shmFd = -1;
+	int syncFd = -1;
+	SharedMemoryHandlerInternal::PosixSyncBlock* pSyncBlock = nullptr;
+#endif
+	SharedMemoryHandlerInternal::EventHandle hEventRequest = nullptr;
+	SharedMemoryHandlerInternal::EventHandle hEventResponse = nullptr;
+	SharedMemoryHandlerInternal::MutexHandle hMutex = nullptr;
+	void* pMapView = nullptr; //Only replaced under lockMapping
+	//Calls and open AsyncWriters using pMapView, -1 while it is replaced. Users never wait for it, so a thread
+	//with an open AsyncWriter can go on calling the handler, and nobody can wait on a remap that waits on them
+	mutable std::atomic<int32_t> mappingUsers{ 0 };
+	static constexpr int32_t mappingDraining = 1 << 30; //Bit in mappingUsers, see drainMapping
+	uint32_t mappingMode; //MemMapMode bits asked for
+	uint32_t mappedMode = 0; //What the current mapping got
+	uint32_t mappingFaults = 0; //Page faults while mapping it
+	//The arena takes any number of producers without locking, this only guards the bookkeeping for keyed messages
+	std::mutex keyedMessagesLock;
+	std::atomic<bool> hasParkedMessages{ false }; //So plain messages don't need keyedMessagesLock to check
+	std::unordered_map<std::string, KeyedPosition> keyedMessagePositions; //Arena position of the last message per key
+	std::unordered_map<std::string, ParkedMessage> parkedKeyedMessages; //Didn't fit into the arena yet
+
+	//Moving average of how long TeamSpeak took to answer sync requests, decides how long we spin before blocking
+	std::atomic<std::chrono::nanoseconds> syncLatencyAverage{ 20us };
+
+	std::atomic<uint32_t> negotiatedCapabilities{ 0 };
+
+	//Reconnect state, only written under lockMapping
+	static constexpr std::chrono::milliseconds minReconnectBackoff = 50ms;
+	static constexpr std::chrono::milliseconds maxReconnectBackoff = 2s;
+	uint32_t sessionGeneration = 0; //Of the region we are mapped to, 0 before the first connect
+	std::atomic<bool> sessionChanged{ false }; //Handled by pollCompletions, isReady may be called while holding locks
+	std::chrono::milliseconds reconnectBackoff = minReconnectBackoff;
+	std::chrono::steady_clock::time_point nextConnectAttempt;
+	static constexpr std::chrono::milliseconds maxDrainWait = 20ms; //Sync waits check for a drain every 10ms
+	static constexpr std::chrono::milliseconds sessionCheckInterval = 100ms; //isReady, pollCompletions checks every call
+	std::atomic<std::chrono::steady_clock::time_point> nextSessionCheck{};
 };
 
 class SharedMemoryTransfer {
@@ -136,6 +403,6 @@ public:
 	static void close() {};
 	void transactMessage(char *output, int outputSize, const char *input);
 private:
-	SharedMemoryHandler handler;
+	std::unique_ptr<Transport> handler; //Transport::createFromEnvironment
 };
 
@@ -0,0 +1,160 @@
+#ifndef _WIN32
+#include "SharedMemoryTransfer.hpp"
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+using namespace SharedMemoryHandlerInternal;
+
+bool SharedMemoryHandlerInternal::lockNamedMutex(MutexHandle mutex, uint32_t timeoutMs) {
+	return mutex->lock(timeoutMs);
+}
+
+void SharedMemoryHandlerInternal::unlockNamedMutex(MutexHandle mutex) {
+	mutex->unlock();
+}
+
+void SharedMemoryHandlerInternal::signalEvent(EventHandle evt) {
+	evt->set();
+}
+
+void SharedMemoryHandlerInternal::resetEvent(EventHandle evt) {
+	evt->reset();
+}
+
+bool SharedMemoryHandlerInternal::signalAndWait(EventHandle toSignal, EventHandle toWait, uint32_t timeoutMs) {
+	toSignal->set();
+	return toWait->wait(timeoutMs);
+}
+
+bool SharedMemoryHandlerInternal::waitEvent(EventHandle evt, uint32_t timeoutMs) {
+	return evt->wait(timeoutMs);
+}
+
+void SharedMemoryHandlerInternal::cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	asm volatile("yield");
+#endif
+}
+
+uint64_t SharedMemoryHandlerInternal::processPageFaults() {
+	rusage usage {};
+	if (getrusage(RUSAGE_SELF, &usage) == -1)
+		return 0;
+	return static_cast<uint64_t>(usage.ru_minflt) + static_cast<uint64_t>(usage.ru_majflt);
+}
+
+void SharedMemoryHandlerInternal::reportTooBigRequest(std::string_view req, const char* title) {
+	fprintf(stderr, "%s %zu: %.*s\n", title, req.length(), static_cast<int>(req.length()), req.data());
+}
+
+static std::string GetLastErrorString() {
+	return strerror(errno);
+}
+
+bool SharedMemoryHandler::createMemRegion() {
+	if (!pSyncBlock) {
+		syncFd = shm_open(SHAREDMEM_POSIX_SYNC_NAME, O_RDWR, 0);
+		if (syncFd == -1) {
+			if (errno != ENOENT)
+				errorMessage = "TFAR ERR OpenSync " + GetLastErrorString();
+			return false;
+		}
+		auto mapped = mmap(nullptr, sizeof(PosixSyncBlock), PROT_READ | PROT_WRITE, MAP_SHARED, syncFd, 0);
+		if (mapped == MAP_FAILED) {
+			errorMessage = "TFAR ERR MapSync " + GetLastErrorString();
+			close(syncFd);
+			syncFd = -1;
+			return false;
+		}
+		pSyncBlock = static_cast<PosixSyncBlock*>(mapped);
+		hEventRequest = &pSyncBlock->eventRequest;
+		hEventResponse = &pSyncBlock->eventResponse;
+		hMutex = &pSyncBlock->mutex;
+	}
+
+	if (shmFd != -1)
+		close(shmFd);
+	shmFd = shm_open(SHAREDMEM_POSIX_NAME, O_RDWR, 0);
+	if (shmFd == -1) {
+		if (errno != ENOENT)
+			errorMessage = "TFAR ERR OpenFMap " + GetLastErrorString();
+		return false;
+	}
+	return true;
+}
+
+bool SharedMemoryHandler::createMemMap() {
+	if (shmFd == -1) {
+		if (!createMemRegion())
+			return false;
+	}
+	if (pMapView)
+		munmap(pMapView, SHAREDMEM_BUFSIZE);
+
+	struct stat info {};
+	if (fstat(shmFd, &info) == -1 || static_cast<size_t>(info.st_size) < SHAREDMEM_BUFSIZE) {
+		//Consumer created the object but didn't size it yet, mapping would SIGBUS on access
+		pMapView = nullptr;
+		close(shmFd);
+		shmFd = -1;
+		return false;
+	}
+
+	const auto faultsBefore = processPageFaults();
+	int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+	if (mappingMode) //Kernel faults it all in right away
+		flags |= MAP_POPULATE;
+#endif
+	auto mapped = mmap(nullptr, SHAREDMEM_BUFSIZE, PROT_READ | PROT_WRITE, flags, shmFd, 0);
+	if (mapped == MAP_FAILED) {
+		errorMessage = "TFAR ERR MapFile " + GetLastErrorString();
+		pMapView = nullptr;
+		close(shmFd);
+		shmFd = -1;
+		return false;
+	}
+	pMapView = mapped;
+
+	mappedMode = 0;
+	if (mappingMode) {
+#ifndef MAP_POPULATE
+		prefaultPages(pMapView, SHAREDMEM_BUFSIZE);
+#endif
+		mappedMode |= static_cast<uint32_t>(MemMapMode::Prefault);
+	}
+	if ((mappingMode & static_cast<uint32_t>(MemMapMode::Lock)) && lockMemMap())
+		mappedMode |= static_cast<uint32_t>(MemMapMode::Lock);
+	mappingFaults = static_cast<uint32_t>(processPageFaults() - faultsBefore);
+	return true;
+}
+
+bool SharedMemoryHandler::lockMemMap() {
+	//Fails if RLIMIT_MEMLOCK is too small, munmap unlocks it again
+	return mlock(pMapView, SHAREDMEM_BUFSIZE) == 0;
+}
+
+bool SharedMemoryHandler::isMemMapOrphaned() const {
+	//A restarted TeamSpeak unlinks the old object and creates a new one, we still have the old one mapped
+	struct stat info {};
+	return shmFd != -1 && fstat(shmFd, &info) == 0 && info.st_nlink == 0;
+}
+
+void SharedMemoryHandler::releaseMemMap() {
+	if (pMapView) munmap(pMapView, SHAREDMEM_BUFSIZE);
+	if (shmFd != -1) close(shmFd);
+	if (pSyncBlock) munmap(pSyncBlock, sizeof(PosixSyncBlock));
+	if (syncFd != -1) close(syncFd);
+	pMapView = nullptr;
+	pSyncBlock = nullptr;
+	hEventRequest = hEventResponse = nullptr;
+	hMutex = nullptr;
+	shmFd = syncFd = -1;
+}
+#endif
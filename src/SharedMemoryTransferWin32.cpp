@@ -0,0 +1,170 @@
+#ifdef _WIN32
+#include "SharedMemoryTransfer.hpp"
+#include <Psapi.h>
+#include <string>
+using namespace SharedMemoryHandlerInternal;
+
+bool SharedMemoryHandlerInternal::lockNamedMutex(MutexHandle mutex, uint32_t timeoutMs) {
+	return WaitForSingleObject(mutex, timeoutMs) == WAIT_OBJECT_0;
+}
+
+void SharedMemoryHandlerInternal::unlockNamedMutex(MutexHandle mutex) {
+	ReleaseMutex(mutex);
+}
+
+void SharedMemoryHandlerInternal::signalEvent(EventHandle evt) {
+	SetEvent(evt);
+}
+
+void SharedMemoryHandlerInternal::resetEvent(EventHandle evt) {
+	ResetEvent(evt);
+}
+
+bool SharedMemoryHandlerInternal::signalAndWait(EventHandle toSignal, EventHandle toWait, uint32_t timeoutMs) {
+	return SignalObjectAndWait(toSignal, toWait, timeoutMs, FALSE) == WAIT_OBJECT_0;
+}
+
+bool SharedMemoryHandlerInternal::waitEvent(EventHandle evt, uint32_t timeoutMs) {
+	return WaitForSingleObject(evt, timeoutMs) == WAIT_OBJECT_0;
+}
+
+void SharedMemoryHandlerInternal::cpuRelax() {
+	YieldProcessor();
+}
+
+uint64_t SharedMemoryHandlerInternal::processPageFaults() {
+	PROCESS_MEMORY_COUNTERS counters{};
+	counters.cb = sizeof(counters);
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return 0;
+	return counters.PageFaultCount;
+}
+
+void SharedMemoryHandlerInternal::reportTooBigRequest(std::string_view req, const char* title) {
+	MessageBoxA(0, (std::string(req) + std::to_string(req.length())).c_str(), title, 0);
+	__debugbreak();
+}
+
+std::string GetLastErrorString() {
+	LPSTR messageBuffer = nullptr;
+	size_t size = FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+		NULL, GetLastError(), MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPSTR) &messageBuffer, 0, NULL);
+	std::string message(messageBuffer, size);
+
+	//Free the buffer.
+	LocalFree(messageBuffer);
+	return message;
+}
+
+bool SharedMemoryHandler::createMemRegion() {
+	if (!hEventRequest) {
+		hEventRequest = OpenEventW(
+			SYNCHRONIZE | EVENT_MODIFY_STATE,
+			FALSE,
+			L"Local\\TFARSHAMEM_EVTREQ"
+		);
+		if (!hEventRequest) {
+			if (GetLastError() != ERROR_FILE_NOT_FOUND)
+				errorMessage = "TFAR ERR OpenEvt REQ " + GetLastErrorString();
+			return false;
+		}
+	}
+	if (!hEventResponse) {
+		hEventResponse = OpenEventW(
+			SYNCHRONIZE | EVENT_MODIFY_STATE,
+			FALSE,
+			L"Local\\TFARSHAMEM_EVTRESP"
+		);
+		if (!hEventResponse) {
+			if (GetLastError() != ERROR_FILE_NOT_FOUND)
+				errorMessage = "TFAR ERR OpenEvt RESP " + GetLastErrorString();
+			return false;
+		}
+	}
+	if (!hMutex) {
+		hMutex = OpenMutexW(
+			SYNCHRONIZE,
+			FALSE,
+			L"Local\\TFARSHAMEM_MTX"
+		);
+		if (!hMutex) {
+			if (GetLastError() != ERROR_FILE_NOT_FOUND)
+				errorMessage = "TFAR ERR OpenMtx " + GetLastErrorString();
+			return false;
+		}
+	}
+
+	if (hMapFile)
+		CloseHandle(hMapFile);
+	hMapFile = OpenFileMappingW(
+		FILE_MAP_WRITE,    // read/write access
+		FALSE,                  // do not inherit the name
+		L"Local\\TFARSHAMEM");             // name of mapping object
+	if (!hMapFile) {
+		if (GetLastError() != ERROR_FILE_NOT_FOUND)
+			errorMessage = "TFAR ERR OpenFMap " + GetLastErrorString();
+		return false;
+	}
+	return true;
+}
+
+bool SharedMemoryHandler::createMemMap() {
+	if (!hMapFile) {
+		if (!createMemRegion())
+			return false;
+	}
+	if (pMapView)
+		UnmapViewOfFile(pMapView);
+
+	const auto faultsBefore = processPageFaults();
+	pMapView = MapViewOfFile(hMapFile,   // handle to map object
+		FILE_MAP_WRITE, // read/write permission
+		0,
+		0,
+		SHAREDMEM_BUFSIZE);
+	if (!pMapView) {
+		if (GetLastError() != ERROR_FILE_NOT_FOUND)
+			errorMessage = "TFAR ERR MapFile " + GetLastErrorString();
+		if (hMapFile) {
+			CloseHandle(hMapFile);
+			hMapFile = nullptr;
+		}
+		return false;
+	}
+
+	mappedMode = 0;
+	if (mappingMode) {
+		prefaultPages(pMapView, SHAREDMEM_BUFSIZE);
+		mappedMode |= static_cast<uint32_t>(MemMapMode::Prefault);
+	}
+	if ((mappingMode & static_cast<uint32_t>(MemMapMode::Lock)) && lockMemMap())
+		mappedMode |= static_cast<uint32_t>(MemMapMode::Lock);
+	mappingFaults = static_cast<uint32_t>(processPageFaults() - faultsBefore);
+	return true;
+}
+
+bool SharedMemoryHandler::lockMemMap() {
+	if (VirtualLock(pMapView, SHAREDMEM_BUFSIZE))
+		return true;
+	//Locked pages count against the minimum working set, which is small by default. UnmapViewOfFile unlocks them again
+	size_t minimumSize, maximumSize;
+	if (!GetProcessWorkingSetSize(GetCurrentProcess(), &minimumSize, &maximumSize) ||
+		!SetProcessWorkingSetSize(GetCurrentProcess(), minimumSize + SHAREDMEM_BUFSIZE, (std::max)(maximumSize, minimumSize + SHAREDMEM_BUFSIZE)))
+		return false;
+	return VirtualLock(pMapView, SHAREDMEM_BUFSIZE) != FALSE;
+}
+
+bool SharedMemoryHandler::isMemMapOrphaned() const {
+	//Named objects live as long as someone has a handle, a restarted TeamSpeak reinitializes ours in place
+	return false;
+}
+
+void SharedMemoryHandler::releaseMemMap() {
+	if (pMapView) UnmapViewOfFile(pMapView);
+	if (hMapFile) CloseHandle(hMapFile);
+	if (hEventRequest) CloseHandle(hEventRequest);
+	if (hEventResponse) CloseHandle(hEventResponse);
+	if (hMutex) CloseHandle(hMutex);
+	pMapView = hMapFile = hEventRequest = hEventResponse = hMutex = nullptr;
+}
+#endif
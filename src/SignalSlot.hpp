@@ -20,7 +20,7 @@ public:
     std::vector<ReturnType> emit(Args... args) const {
         std::vector<ReturnType> returnData;
         if (slots.empty())
-            return;
+            return returnData;
         for (auto &slot : slots) {
             returnData.push_back(slot(args...));
         }
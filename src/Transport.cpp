@@ -0,0 +1,293 @@
+#include "Transport.hpp"
+#include "MessageCompression.hpp"
+#include "PipeTransport.hpp"
+#include "SharedMemoryTransfer.hpp"
+#include <algorithm>
+#include <charconv>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+using namespace SharedMemoryHandlerInternal;
+
+static uint32_t latencyBucket(std::chrono::microseconds::rep micros) {
+	uint32_t bucket = 0;
+	while (bucket < SHAREDMEM_LATENCY_BUCKETS - 1 && micros >= (1ll << bucket))
+		++bucket;
+	return bucket;
+}
+
+static void raiseHighWater(std::atomic<uint32_t>& highWater, uint32_t usedBytes) {
+	auto current = highWater.load(std::memory_order_relaxed);
+	while (usedBytes > current && !highWater.compare_exchange_weak(current, usedBytes, std::memory_order_relaxed)) {}
+}
+
+void SharedMemoryHandlerInternal::TransportTelemetry::countAsyncEnqueued(uint32_t length, uint32_t usedBytes, MessageLane lane) {
+	asyncEnqueued.fetch_add(1, std::memory_order_relaxed);
+	asyncEnqueuedBytes.fetch_add(length, std::memory_order_relaxed);
+	laneEnqueued[static_cast<size_t>(lane)].fetch_add(1, std::memory_order_relaxed);
+	raiseHighWater(asyncHighWater, usedBytes);
+	raiseHighWater(laneHighWater[static_cast<size_t>(lane)], usedBytes);
+}
+
+void SharedMemoryHandlerInternal::TransportTelemetry::countAsyncDropped(MessageLane lane) {
+	asyncDropped.fetch_add(1, std::memory_order_relaxed);
+	laneDropped[static_cast<size_t>(lane)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void SharedMemoryHandlerInternal::TransportTelemetry::countSyncLatency(std::chrono::nanoseconds latency) {
+	syncRequests.fetch_add(1, std::memory_order_relaxed);
+	syncLatency[latencyBucket(std::chrono::duration_cast<std::chrono::microseconds>(latency).count())].fetch_add(1, std::memory_order_relaxed);
+}
+
+void SharedMemoryHandlerInternal::TransportTelemetry::countCompressed(size_t originalLength, size_t length) {
+	asyncCompressed.fetch_add(1, std::memory_order_relaxed);
+	asyncCompressedBytesSaved.fetch_add(originalLength - length, std::memory_order_relaxed);
+}
+
+template <typename Type>
+static void copyCounter(const std::atomic<Type>& from, std::atomic<Type>& to) {
+	to.store(from.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+template <typename Type, size_t Size>
+static void copyCounter(const Type (&from)[Size], Type (&to)[Size]) {
+	for (size_t i = 0; i < Size; ++i)
+		copyCounter(from[i], to[i]);
+}
+
+void SharedMemoryHandlerInternal::TransportTelemetry::copyTo(TransportTelemetry& copy) const {
+	copyCounter(asyncEnqueued, copy.asyncEnqueued);
+	copyCounter(asyncEnqueuedBytes, copy.asyncEnqueuedBytes);
+	copyCounter(asyncDropped, copy.asyncDropped);
+	copyCounter(asyncRejected, copy.asyncRejected);
+	copyCounter(asyncHighWater, copy.asyncHighWater);
+	copyCounter(asyncCompressed, copy.asyncCompressed);
+	copyCounter(asyncCompressedBytesSaved, copy.asyncCompressedBytesSaved);
+	copyCounter(syncRequests, copy.syncRequests);
+	copyCounter(syncTimeouts, copy.syncTimeouts);
+	copyCounter(pipelinedRequests, copy.pipelinedRequests);
+	copyCounter(pipelinedTimeouts, copy.pipelinedTimeouts);
+	copyCounter(syncLatency, copy.syncLatency);
+	copyCounter(laneEnqueued, copy.laneEnqueued);
+	copyCounter(laneDropped, copy.laneDropped);
+	copyCounter(laneHighWater, copy.laneHighWater);
+	copyCounter(mappingMode, copy.mappingMode);
+	copyCounter(mappingFaults, copy.mappingFaults);
+}
+
+template <typename Type, typename Value>
+static void addSingleWriter(std::atomic<Type>& counter, Value value) {
+	//Only one thread ever writes, no need for a locked read-modify-write
+	counter.store(counter.load(std::memory_order_relaxed) + static_cast<Type>(value), std::memory_order_relaxed);
+}
+
+void SharedMemoryHandlerInternal::ConsumerTelemetry::countConsumed(const MessageStamp& stamp, uint64_t consumeTime) {
+	const auto lane = static_cast<size_t>(stamp.lane);
+	//Clocks of the same machine, but don't let a bogus stamp wrap around
+	const auto dataAgeMicros = consumeTime > stamp.captureTime ? consumeTime - stamp.captureTime : 0;
+	const auto queueDelayMicros = consumeTime > stamp.enqueueTime ? consumeTime - stamp.enqueueTime : 0;
+	addSingleWriter(stampedMessages[lane], 1);
+	lastConsumeTime[lane].store(consumeTime, std::memory_order_relaxed);
+	lastDataAge[lane].store(static_cast<uint32_t>((std::min)(dataAgeMicros, uint64_t(UINT32_MAX))), std::memory_order_relaxed);
+	lastQueueDelay[lane].store(static_cast<uint32_t>((std::min)(queueDelayMicros, uint64_t(UINT32_MAX))), std::memory_order_relaxed);
+	addSingleWriter(dataAgeTotal[lane], dataAgeMicros);
+	addSingleWriter(queueDelayTotal[lane], queueDelayMicros);
+	addSingleWriter(dataAge[lane][latencyBucket(static_cast<std::chrono::microseconds::rep>((std::min)(dataAgeMicros, uint64_t(INT64_MAX))))], 1);
+}
+
+void SharedMemoryHandlerInternal::ConsumerTelemetry::copyTo(ConsumerTelemetry& copy) const {
+	copyCounter(stampedMessages, copy.stampedMessages);
+	copyCounter(lastConsumeTime, copy.lastConsumeTime);
+	copyCounter(lastDataAge, copy.lastDataAge);
+	copyCounter(lastQueueDelay, copy.lastQueueDelay);
+	copyCounter(dataAgeTotal, copy.dataAgeTotal);
+	copyCounter(queueDelayTotal, copy.queueDelayTotal);
+	copyCounter(dataAge, copy.dataAge);
+}
+
+std::unique_ptr<Transport> Transport::createFromEnvironment() {
+	const char* transport = getenv("TFAR_TRANSPORT");
+	if (transport && strcmp(transport, "pipe") == 0) {
+		const char* path = getenv("TFAR_PIPE_PATH");
+		return std::make_unique<PipeTransport>(path ? path : "");
+	}
+	uint32_t mapping = SHAREDMEM_DEFAULT_MAPPING;
+	const char* mappingName = getenv("TFAR_SHAREDMEM_MAPPING");
+	if (mappingName && !SharedMemoryHandlerInternal::parseMemMapMode(mappingName, mapping))
+		mapping = SHAREDMEM_DEFAULT_MAPPING;
+	return std::make_unique<SharedMemoryHandler>(mapping);
+}
+
+Transport::AsyncWriter::AsyncWriter(AsyncWriter&& other) noexcept :
+	transport(other.transport), lane(other.lane), captureTime(other.captureTime), buffer(other.buffer), ownedBuffer(std::move(other.ownedBuffer)),
+	recordPosition(other.recordPosition), capacity(other.capacity), length(other.length), stampLength(other.stampLength), overflow(other.overflow) {
+	other.buffer = nullptr;
+	other.transport = nullptr;
+}
+
+Transport::AsyncWriter& Transport::AsyncWriter::operator+=(std::string_view text) {
+	if (text.length() > capacity - length) {
+		overflow = true;
+		return *this;
+	}
+	memcpy(buffer + length, text.data(), text.length());
+	length += static_cast<uint32_t>(text.length());
+	return *this;
+}
+
+Transport::AsyncWriter& Transport::AsyncWriter::operator+=(char character) {
+	return *this += std::string_view(&character, 1);
+}
+
+bool Transport::AsyncWriter::commit() {
+	if (!buffer || overflow) return false;
+	bool result = transport->commitAsyncWriter(*this, nullptr);
+	buffer = nullptr;
+	transport = nullptr;
+	ownedBuffer.reset();
+	return result;
+}
+
+bool Transport::AsyncWriter::commit(const std::string& key) {
+	if (!buffer || overflow) return false;
+	bool result = transport->commitAsyncWriter(*this, &key);
+	buffer = nullptr;
+	transport = nullptr;
+	ownedBuffer.reset();
+	return result;
+}
+
+void Transport::AsyncWriter::cancel() {
+	if (!buffer) return;
+	transport->cancelAsyncWriter(*this);
+	buffer = nullptr;
+	transport = nullptr;
+	ownedBuffer.reset();
+}
+
+std::future<std::string> Transport::doPipelinedRequest(std::string_view request, MessageLane lane, std::chrono::steady_clock::time_point captureTime) {
+	auto promise = std::make_shared<std::promise<std::string>>();
+	auto future = promise->get_future();
+	auto requestID = doPipelinedRequest(request, [promise](bool success, std::string_view answer) {
+		if (success)
+			promise->set_value(std::string(answer));
+		else
+			promise->set_exception(std::make_exception_ptr(std::runtime_error("TFAR pipelined request failed")));
+	}, lane, captureTime);
+	if (requestID == 0)
+		promise->set_exception(std::make_exception_ptr(std::runtime_error("TFAR pipelined request couldn't be queued")));
+	return future;
+}
+
+size_t Transport::getPendingRequestCount() {
+	std::unique_lock pendingLock(pendingRequestsLock);
+	return pendingRequests.size();
+}
+
+std::string_view Transport::stampAsyncRequest(std::string_view request, const MessageStamp& stamp) {
+	if (!isCapabilityActive(TransportCapability::MessageTimestamps))
+		return request;
+	thread_local std::string buffer; //Keeps its capacity
+	buffer.resize(MESSAGE_STAMP_LENGTH);
+	writeMessageStamp(stamp, buffer.data());
+	buffer.append(request);
+	return buffer;
+}
+
+std::string_view Transport::compressAsyncRequest(std::string_view request, TransportTelemetry* telemetry) {
+	if (request.length() < SHAREDMEM_COMPRESSION_THRESHOLD || !isCapabilityActive(TransportCapability::CompressedMessages))
+		return request;
+	//Has to save at least an eighth, below that TeamSpeak spends more time decompressing than the smaller copy saves
+	const size_t maxLength = request.length() - request.length() / 8;
+	thread_local std::vector<char> buffer;
+	if (buffer.size() < maxLength)
+		buffer.resize(maxLength);
+
+	char* record = buffer.data();
+	memcpy(record, "CMP\t", 4);
+	char* header = std::to_chars(record + 4, record + maxLength, request.length()).ptr;
+	*header++ = '\t';
+	const auto headerLength = static_cast<size_t>(header - record);
+	const auto compressedLength = compressMessage(request, header, maxLength - headerLength);
+	if (compressedLength == 0)
+		return request;
+	telemetry->countCompressed(request.length(), headerLength + compressedLength);
+	return { record, headerLength + compressedLength };
+}
+
+uint32_t Transport::takeRequestID() {
+	auto requestID = nextRequestID++;
+	if (nextRequestID == 0) nextRequestID = 1; //0 is the error value
+	return requestID;
+}
+
+void Transport::dispatchCompletions(std::unique_lock<std::mutex>& pendingLock, TransportTelemetry* telemetry) {
+	std::vector<std::pair<RequestCallback, std::string>> finished;
+	std::vector<RequestCallback> timedOut;
+	for (auto it = receivedCompletions.begin(); it != receivedCompletions.end();) {
+		auto found = pendingRequests.find(it->first);
+		if (found == pendingRequests.end()) { //Already timed out
+			it = receivedCompletions.erase(it);
+			continue;
+		}
+		if (found->second.awaited) { //The waiting thread picks it up
+			++it;
+			continue;
+		}
+		finished.emplace_back(std::move(found->second.callback), std::move(it->second));
+		pendingRequests.erase(found);
+		it = receivedCompletions.erase(it);
+	}
+
+	auto now = std::chrono::steady_clock::now();
+	for (auto it = pendingRequests.begin(); it != pendingRequests.end();) {
+		if (!it->second.awaited && now - it->second.sendTime > std::chrono::milliseconds(PIPE_TIMEOUT)) {
+			timedOut.emplace_back(std::move(it->second.callback));
+			it = pendingRequests.erase(it);
+		} else {
+			++it;
+		}
+	}
+	pendingLock.unlock();
+
+	if (!timedOut.empty())
+		telemetry->pipelinedTimeouts.fetch_add(timedOut.size(), std::memory_order_relaxed);
+	for (auto& [callback, answer] : finished)
+		if (callback) callback(true, answer);
+	for (auto& callback : timedOut)
+		if (callback) callback(false, {});
+}
+
+void Transport::failPendingRequests() {
+	std::vector<RequestCallback> failed;
+	{
+		std::unique_lock pendingLock(pendingRequestsLock);
+		receivedCompletions.clear();
+		for (auto it = pendingRequests.begin(); it != pendingRequests.end();) {
+			if (it->second.awaited) {
+				++it;
+				continue;
+			}
+			failed.emplace_back(std::move(it->second.callback));
+			it = pendingRequests.erase(it);
+		}
+	}
+	for (auto& callback : failed)
+		if (callback) callback(false, {});
+}
+
+TransportCapture& Transport::getCapture() {
+	static TransportCapture capture; //Both Controller and SharedMemoryTransfer have their own transport, one file for all
+	return capture;
+}
+
+bool Transport::startCapture(const std::string& path, std::string& error) {
+	if (getCapture().start(path))
+		return true;
+	error = getCapture().errorMessage;
+	return false;
+}
+
+void Transport::stopCapture() {
+	getCapture().stop();
+}
@@ -0,0 +1,224 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "MessageStamp.hpp"
+#include "SignalSlot.hpp"
+#include "TransportCapture.hpp"
+
+using namespace std::chrono_literals;
+
+#define PIPE_NAME L"\\\\.\\pipe\\task_force_radio_pipe"
+#define DEBUG_PIPE_NAME L"\\\\.\\pipe\\task_force_radio_pipe_debug"
+#define DEBUG_PARAMETER L"-tfdebug"
+#define PIPE_POSIX_PATH "/tmp/task_force_radio_pipe" //Unix domain socket, bind mount it to reach a consumer in another container
+#define PIPE_TIMEOUT 1000
+
+#define SHAREDMEM_MAX_PIPELINED_REQUESTS 64
+#define SHAREDMEM_LATENCY_BUCKETS 20
+#define SHAREDMEM_COMPRESSION_THRESHOLD 512 //Smaller messages aren't worth it, most of them don't repeat anything anyway
+
+/*
+What the game plugin talks to TeamSpeak through. SharedMemoryHandler is the default, PipeTransport carries the same
+messages over a named pipe or Unix domain socket, so TeamSpeak or a test consumer can also run in another process or container.
+Message formats ("REQ" pipelined requests, "CMP" compressed messages, keyed replacement, capabilities) are the same
+on every transport, only how the bytes get across differs. Every method may be called from any thread.
+*/
+
+//Optional protocol features, negotiated between game and TeamSpeak on connect
+enum class TransportCapability : uint32_t {
+	BinaryPositions = 1 << 0, //POSBATCHB frames of BinaryPositionRecord, see PositionRecord.hpp
+	PositionDeltas = 1 << 1, //POSBATCHD frames of delta encoded positions, see PositionRecord.hpp
+	SyncResponseSequence = 1 << 2, //Publishes syncResponseSequence with every sync answer, shared memory only
+	PipelinedRequests = 1 << 3, //Answers "REQ" records with completions, needed for sync requests that don't fit the shared memory slot
+	CompressedMessages = 1 << 4, //Decompresses "CMP" async records
+	MessageTimestamps = 1 << 5, //Strips "TS" stamps and reports data age in ConsumerTelemetry, see MessageStamp.hpp
+	PositionBatches = 1 << 6 //Splits POSBATCH frames of text records. Without it, or a binary encoding, every POS line is its own request
+};
+
+//Async traffic classes. Every lane has its own queue and capacity, TeamSpeak drains Control, then Realtime, then Bulk,
+//so a burst of radio lists never delays position updates. Messages are only ordered within a lane
+enum class MessageLane : uint8_t {
+	Control, //Small and rare, DFRAME, MISSIONEND and everything else transactMessage sends async
+	Realtime, //Position batches
+	Bulk //SPEAKERS radio lists and anything else big
+};
+constexpr size_t MESSAGE_LANE_COUNT = 3;
+
+namespace SharedMemoryHandlerInternal {
+	//Written by the game only. Tells whether lag comes from the plugin, the transport or a consumer that doesn't keep up.
+	//Lives in the shared memory region for SharedMemoryHandler, in process for the other transports
+	struct TransportTelemetry {
+		std::atomic<uint64_t> asyncEnqueued{ 0 };
+		std::atomic<uint64_t> asyncEnqueuedBytes{ 0 };
+		std::atomic<uint64_t> asyncDropped{ 0 }; //Queue was full, message is lost
+		std::atomic<uint64_t> asyncRejected{ 0 }; //canDoAsyncRequest returned false
+		std::atomic<uint32_t> asyncHighWater{ 0 }; //Most bytes ever queued in one lane
+		std::atomic<uint64_t> asyncCompressed{ 0 }; //Async messages that were turned into "CMP" records
+		std::atomic<uint64_t> asyncCompressedBytesSaved{ 0 }; //Original minus sent length of those
+		std::atomic<uint64_t> syncRequests{ 0 };
+		std::atomic<uint64_t> syncTimeouts{ 0 };
+		std::atomic<uint64_t> pipelinedRequests{ 0 };
+		std::atomic<uint64_t> pipelinedTimeouts{ 0 };
+		//Sync round trips, bucket i counts answers faster than 2^i microseconds, the last one everything slower
+		std::atomic<uint32_t> syncLatency[SHAREDMEM_LATENCY_BUCKETS]{};
+		//Per MessageLane, asyncEnqueued and asyncDropped split up
+		std::atomic<uint64_t> laneEnqueued[MESSAGE_LANE_COUNT]{};
+		std::atomic<uint64_t> laneDropped[MESSAGE_LANE_COUNT]{};
+		std::atomic<uint32_t> laneHighWater[MESSAGE_LANE_COUNT]{};
+		//SharedMemoryHandler only. MemMapMode bits the mapping got and page faults of the whole process while setting it up
+		std::atomic<uint32_t> mappingMode{ 0 };
+		std::atomic<uint32_t> mappingFaults{ 0 };
+
+		void countAsyncEnqueued(uint32_t length, uint32_t usedBytes, MessageLane lane);
+		void countAsyncDropped(MessageLane lane);
+		void countSyncLatency(std::chrono::nanoseconds latency);
+		void countCompressed(size_t originalLength, size_t length);
+		void copyTo(TransportTelemetry& copy) const; //Counter by counter, not a consistent snapshot
+	};
+
+	//Written by one TeamSpeak thread only, from the "TS" stamps of TransportCapability::MessageTimestamps, per MessageLane.
+	//Data age is consume minus capture time, queue delay consume minus enqueue time, both in microseconds.
+	//Lives in the shared memory region after TransportTelemetry. PipeTransport fills its own from the Consumed frames TeamSpeak sends back
+	struct ConsumerTelemetry {
+		std::atomic<uint64_t> stampedMessages[MESSAGE_LANE_COUNT]{};
+		std::atomic<uint64_t> lastConsumeTime[MESSAGE_LANE_COUNT]{}; //steady_clock microseconds
+		std::atomic<uint32_t> lastDataAge[MESSAGE_LANE_COUNT]{};
+		std::atomic<uint32_t> lastQueueDelay[MESSAGE_LANE_COUNT]{};
+		std::atomic<uint64_t> dataAgeTotal[MESSAGE_LANE_COUNT]{};
+		std::atomic<uint64_t> queueDelayTotal[MESSAGE_LANE_COUNT]{};
+		//Bucket i counts messages whose data was younger than 2^i microseconds, like TransportTelemetry::syncLatency
+		std::atomic<uint32_t> dataAge[MESSAGE_LANE_COUNT][SHAREDMEM_LATENCY_BUCKETS]{};
+
+		void countConsumed(const MessageStamp& stamp, uint64_t consumeTime);
+		void copyTo(ConsumerTelemetry& copy) const;
+	};
+}
+
+class Transport {
+public:
+	//success is false if the request timed out or the connection got lost, answer is only valid during the call
+	using RequestCallback = std::function<void(bool success, std::string_view answer)>;
+
+	//Formats a message directly into the transport's queue where it can, the shared memory arena for SharedMemoryHandler.
+	//The space is claimed right away, TeamSpeak can't read anything queued after it until commit or destruction,
+	//so keep the time between reserveAsyncRequest and commit short
+	class AsyncWriter {
+	public:
+		AsyncWriter() = default;
+		AsyncWriter(AsyncWriter&& other) noexcept;
+		AsyncWriter& operator=(AsyncWriter&&) = delete;
+		~AsyncWriter() { cancel(); }
+
+		explicit operator bool() const { return buffer != nullptr; }
+		AsyncWriter& operator+=(std::string_view text);
+		AsyncWriter& operator+=(char character);
+		void pop_back() { if (length) --length; }
+		bool empty() const { return length == 0; }
+		bool overflowed() const { return overflow; } //More was written than reserved, commit will fail
+		std::string_view view() const { return { buffer, length }; }
+		operator std::string_view() const { return view(); }
+
+		bool commit();
+		bool commit(const std::string& key); //See doAsyncRequest(request, key)
+		void cancel();
+	private:
+		friend class SharedMemoryHandler;
+		friend class PipeTransport;
+		Transport* transport = nullptr;
+		MessageLane lane = MessageLane::Bulk;
+		std::chrono::steady_clock::time_point captureTime; //Stamped on commit
+		char* buffer = nullptr;
+		std::unique_ptr<char[]> ownedBuffer; //For transports that can't hand out their queue, buffer points into it
+		uint32_t recordPosition = 0; //Transport specific, where the space was claimed
+		uint32_t capacity = 0;
+		uint32_t length = 0;
+		uint32_t stampLength = 0; //Reserved in front of buffer for the "TS" stamp
+		bool overflow = false;
+	};
+
+	//PipeTransport if the environment variable TFAR_TRANSPORT is "pipe", TFAR_PIPE_PATH overrides where it connects to.
+	//SharedMemoryHandler otherwise, mapped as TFAR_SHAREDMEM_MAPPING says
+	static std::unique_ptr<Transport> createFromEnvironment();
+
+	virtual ~Transport() = default;
+	virtual bool canDoAsyncRequest(MessageLane lane = MessageLane::Bulk) const = 0;
+	virtual bool doSyncRequest(std::string_view request, std::string& answer) = 0;
+	//Writes the answer into output, truncated and null terminated. No heap allocation once warmed up
+	virtual bool doSyncRequest(std::string_view request, char* output, size_t outputSize) = 0;
+	//captureTime is when the data in the message was sampled, defaults to now. Only used for TransportCapability::MessageTimestamps
+	virtual bool doAsyncRequest(std::string_view request, MessageLane lane = MessageLane::Bulk, std::chrono::steady_clock::time_point captureTime = {}) = 0;
+	//Replaces an older not yet consumed message with the same key. If the queue is full the message is held back,
+	//only the newest one per key, and sent as soon as there is space again. Always use the same lane for a key
+	virtual bool doAsyncRequest(std::string_view request, const std::string& key, MessageLane lane = MessageLane::Bulk,
+		std::chrono::steady_clock::time_point captureTime = {}) = 0;
+	//maxLength can be up to the maxRecordSize of the lane's arena, SharedMemoryHandlerInternal::AsyncMessageArena for Bulk.
+	//With MessageTimestamps the stamp takes MESSAGE_STAMP_LENGTH of that, the writer may get less capacity.
+	//Invalid writer if there is no space
+	virtual AsyncWriter reserveAsyncRequest(uint32_t maxLength, MessageLane lane = MessageLane::Bulk, std::chrono::steady_clock::time_point captureTime = {}) = 0;
+	//TeamSpeak handles the async request before the sync one, it drains every lane before looking at sync requests
+	virtual bool doSyncAndAsyncRequest(std::string_view syncRequest, std::string& answer, std::string_view asyncRequest) = 0;
+	//Doesn't wait for the answer. Callback is called from pollCompletions. Returns 0 if the request couldn't be queued
+	virtual uint32_t doPipelinedRequest(std::string_view request, RequestCallback callback, MessageLane lane = MessageLane::Realtime,
+		std::chrono::steady_clock::time_point captureTime = {}) = 0;
+	std::future<std::string> doPipelinedRequest(std::string_view request, MessageLane lane = MessageLane::Realtime,
+		std::chrono::steady_clock::time_point captureTime = {});
+	//Matches answers to outstanding requests and times out old ones.
+	//Also detects a new TeamSpeak session and reconnects, call it regularly from the thread that sends
+	virtual void pollCompletions() = 0;
+	size_t getPendingRequestCount();
+	virtual bool isConnected() = 0;
+	virtual bool needsConfigRefresh() = 0;
+	//Both sides support it. Renegotiates first if TeamSpeak changed what it announces
+	virtual bool isCapabilityActive(TransportCapability cap) = 0;
+	virtual uint32_t getNegotiatedCapabilities() = 0; //0 if not connected
+	//Copy the counters, false if not connected. The originals may live in a mapping that gets replaced any time
+	virtual bool getTelemetry(SharedMemoryHandlerInternal::TransportTelemetry& copy) = 0;
+	virtual bool getConsumerTelemetry(SharedMemoryHandlerInternal::ConsumerTelemetry& copy) = 0;
+	virtual bool isReady() = 0; //Connects if needed. After a failed attempt it waits a backoff before trying again
+	virtual void shutdown() = 0; //Mission ended
+	std::string errorMessage;
+
+	//Appends every message any transport of this process sends to a capture file, see TransportCapture.hpp.
+	//Replaces a running capture. tfar_transport_replay plays it back
+	static bool startCapture(const std::string& path, std::string& error);
+	static void stopCapture();
+
+	//Called from pollCompletions after reconnecting to a new TeamSpeak session. Pending requests already failed,
+	//nothing that was sent before reached TeamSpeak, so resend full state
+	Signal<void()> onNewSession;
+protected:
+	struct PendingRequest {
+		RequestCallback callback;
+		std::chrono::steady_clock::time_point sendTime;
+		bool awaited; //Someone is blocking on it, pollCompletions leaves it alone
+	};
+
+	virtual bool commitAsyncWriter(AsyncWriter& writer, const std::string* key) = 0;
+	virtual void cancelAsyncWriter(AsyncWriter& writer) = 0;
+	//Stamp and request in a per thread buffer, valid until the next call. request itself if MessageTimestamps isn't active.
+	//Comes before compressAsyncRequest, "CMP" goes around the stamp
+	std::string_view stampAsyncRequest(std::string_view request, const SharedMemoryHandlerInternal::MessageStamp& stamp);
+	//The "CMP" record for request in a per thread buffer, valid until the next call. request itself if it's not worth it
+	std::string_view compressAsyncRequest(std::string_view request, SharedMemoryHandlerInternal::TransportTelemetry* telemetry);
+	uint32_t takeRequestID(); //Needs pendingRequestsLock
+	//Hands receivedCompletions to their callbacks and times out old requests. Needs pendingRequestsLock, releases it
+	//before calling callbacks, they may queue new requests
+	void dispatchCompletions(std::unique_lock<std::mutex>& pendingLock, SharedMemoryHandlerInternal::TransportTelemetry* telemetry);
+	void failPendingRequests(); //Connection is gone, awaited ones time out on their own
+	static SharedMemoryHandlerInternal::TransportCapture& getCapture();
+
+	std::mutex pendingRequestsLock;
+	std::unordered_map<uint32_t, PendingRequest> pendingRequests;
+	std::vector<std::pair<uint32_t, std::string>> receivedCompletions;
+	uint32_t nextRequestID = 1;
+};
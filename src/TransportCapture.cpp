@@ -0,0 +1,262 @@
+#include "TransportCapture.hpp"
+#include "Transport.hpp"
+#include <algorithm>
+#include <cstring>
+#include <new>
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+using namespace SharedMemoryHandlerInternal;
+
+#ifdef _WIN32
+std::string GetLastErrorString(); //SharedMemoryTransferWin32.cpp
+
+bool MappedFile::create(const std::string& path, uint64_t size) {
+	close();
+	hFile = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		errorMessage = "TFAR ERR CreateCaptureFile " + GetLastErrorString();
+		return false;
+	}
+	mappedSize = size;
+	return map(true);
+}
+
+bool MappedFile::openReadOnly(const std::string& path) {
+	close();
+	hFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	LARGE_INTEGER fileSize{};
+	if (hFile == INVALID_HANDLE_VALUE || !GetFileSizeEx(hFile, &fileSize)) {
+		errorMessage = "TFAR ERR OpenCaptureFile " + GetLastErrorString();
+		close();
+		return false;
+	}
+	mappedSize = static_cast<uint64_t>(fileSize.QuadPart);
+	return map(false);
+}
+
+bool MappedFile::map(bool writable) {
+	//Mapping a writable file bigger than it is extends it
+	hMapping = CreateFileMappingA(hFile, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY,
+		static_cast<DWORD>(mappedSize >> 32), static_cast<DWORD>(mappedSize), nullptr);
+	if (hMapping)
+		view = static_cast<char*>(MapViewOfFile(hMapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0));
+	if (!view) {
+		errorMessage = "TFAR ERR MapCaptureFile " + GetLastErrorString();
+		close();
+		return false;
+	}
+	return true;
+}
+
+void MappedFile::unmap() {
+	if (view) UnmapViewOfFile(view);
+	if (hMapping) CloseHandle(hMapping);
+	view = nullptr;
+	hMapping = nullptr;
+}
+
+bool MappedFile::resize(uint64_t size) {
+	unmap();
+	mappedSize = size;
+	return map(true);
+}
+
+void MappedFile::close(uint64_t truncateTo) {
+	unmap();
+	if (hFile != INVALID_HANDLE_VALUE) {
+		LARGE_INTEGER end;
+		end.QuadPart = static_cast<LONGLONG>(truncateTo);
+		if (truncateTo != UINT64_MAX && SetFilePointerEx(hFile, end, nullptr, FILE_BEGIN))
+			SetEndOfFile(hFile);
+		CloseHandle(hFile);
+	}
+	hFile = INVALID_HANDLE_VALUE;
+	mappedSize = 0;
+}
+#else
+static std::string GetLastErrorString() {
+	return strerror(errno);
+}
+
+bool MappedFile::create(const std::string& path, uint64_t size) {
+	close();
+	fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1 || ftruncate(fd, static_cast<off_t>(size)) != 0) {
+		errorMessage = "TFAR ERR CreateCaptureFile " + GetLastErrorString();
+		close();
+		return false;
+	}
+	mappedSize = size;
+	return map(true);
+}
+
+bool MappedFile::openReadOnly(const std::string& path) {
+	close();
+	fd = open(path.c_str(), O_RDONLY);
+	struct stat info {};
+	if (fd == -1 || fstat(fd, &info) != 0) {
+		errorMessage = "TFAR ERR OpenCaptureFile " + GetLastErrorString();
+		close();
+		return false;
+	}
+	mappedSize = static_cast<uint64_t>(info.st_size);
+	return map(false);
+}
+
+bool MappedFile::map(bool writable) {
+	auto mapped = mmap(nullptr, mappedSize, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	if (mapped == MAP_FAILED) {
+		errorMessage = "TFAR ERR MapCaptureFile " + GetLastErrorString();
+		close();
+		return false;
+	}
+	view = static_cast<char*>(mapped);
+	return true;
+}
+
+void MappedFile::unmap() {
+	if (view) munmap(view, mappedSize);
+	view = nullptr;
+}
+
+bool MappedFile::resize(uint64_t size) {
+	unmap();
+	mappedSize = size;
+	if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+		errorMessage = "TFAR ERR GrowCaptureFile " + GetLastErrorString();
+		close();
+		return false;
+	}
+	return map(true);
+}
+
+void MappedFile::close(uint64_t truncateTo) {
+	unmap();
+	if (fd != -1) {
+		if (truncateTo != UINT64_MAX && ftruncate(fd, static_cast<off_t>(truncateTo)) != 0)
+			errorMessage = "TFAR ERR TruncateCaptureFile " + GetLastErrorString();
+		::close(fd);
+	}
+	fd = -1;
+	mappedSize = 0;
+}
+#endif
+
+bool TransportCapture::start(const std::string& path) {
+	stop();
+	std::unique_lock guard(lock);
+	if (!file.create(path, TRANSPORT_CAPTURE_GROW_SIZE)) {
+		errorMessage = file.errorMessage;
+		return false;
+	}
+	auto header = new (file.data()) CaptureFileHeader{};
+	header->magic = TRANSPORT_CAPTURE_MAGIC;
+	header->version = TRANSPORT_CAPTURE_VERSION;
+	header->headerSize = TRANSPORT_CAPTURE_HEADER_SIZE;
+	header->startTime = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	header->dataEnd.store(TRANSPORT_CAPTURE_HEADER_SIZE, std::memory_order_release);
+	startTime = std::chrono::steady_clock::now();
+	active = true;
+	return true;
+}
+
+void TransportCapture::stop() {
+	std::unique_lock guard(lock);
+	active = false;
+	if (!file.data()) return;
+	file.close(reinterpret_cast<CaptureFileHeader*>(file.data())->dataEnd.load(std::memory_order_relaxed));
+}
+
+void TransportCapture::record(CaptureRecordKind kind, std::string_view message, std::string_view key, MessageLane lane) {
+	key = key.substr(0, UINT16_MAX);
+	std::unique_lock guard(lock);
+	if (!file.data()) return; //Stopped after the caller checked isActive
+	//Timestamp under the lock, so timestamps never go backwards in the file
+	const auto timestamp = std::chrono::steady_clock::now() - startTime;
+
+	const auto end = reinterpret_cast<CaptureFileHeader*>(file.data())->dataEnd.load(std::memory_order_relaxed);
+	const uint64_t size = (sizeof(CaptureRecordHeader) + key.length() + message.length() + TRANSPORT_CAPTURE_RECORD_ALIGN - 1) &
+		~static_cast<uint64_t>(TRANSPORT_CAPTURE_RECORD_ALIGN - 1);
+	if (end + size > file.size() && !file.resize((std::max)(file.size(), end + size) + TRANSPORT_CAPTURE_GROW_SIZE)) {
+		//Disk full or address space exhausted, the file is still valid up to end
+		errorMessage = file.errorMessage;
+		active = false;
+		return;
+	}
+
+	CaptureRecordHeader recordHeader{};
+	recordHeader.timestamp = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(timestamp).count());
+	recordHeader.length = static_cast<uint32_t>(message.length());
+	recordHeader.keyLength = static_cast<uint16_t>(key.length());
+	recordHeader.kind = kind;
+	recordHeader.lane = lane;
+	char* target = file.data() + end;
+	memcpy(target, &recordHeader, sizeof(recordHeader));
+	memcpy(target + sizeof(recordHeader), key.data(), key.length());
+	memcpy(target + sizeof(recordHeader) + key.length(), message.data(), message.length());
+
+	auto header = reinterpret_cast<CaptureFileHeader*>(file.data());
+	++header->recordCount;
+	header->dataEnd.store(end + size, std::memory_order_release);
+}
+
+bool TransportCaptureReader::open(const std::string& path) {
+	if (!file.openReadOnly(path)) {
+		errorMessage = file.errorMessage;
+		return false;
+	}
+	if (file.size() < TRANSPORT_CAPTURE_HEADER_SIZE || header()->magic != TRANSPORT_CAPTURE_MAGIC) {
+		errorMessage = "TFAR ERR Not a transport capture";
+		file.close();
+		return false;
+	}
+	version = header()->version;
+	if (version != 1 && version != TRANSPORT_CAPTURE_VERSION) {
+		errorMessage = "TFAR ERR Unsupported transport capture version " + std::to_string(header()->version);
+		file.close();
+		return false;
+	}
+	rewind();
+	return true;
+}
+
+bool TransportCaptureReader::next(Record& record) {
+	if (!file.data()) return false;
+	//A capture of a crashed game still has its grow padding behind dataEnd
+	const auto end = (std::min)(header()->dataEnd.load(std::memory_order_acquire), file.size());
+	if (position + sizeof(CaptureRecordHeader) > end) return false;
+
+	CaptureRecordHeader recordHeader;
+	memcpy(&recordHeader, file.data() + position, sizeof(recordHeader));
+	const uint64_t payloadLength = static_cast<uint64_t>(recordHeader.keyLength) + recordHeader.length;
+	if (position + sizeof(CaptureRecordHeader) + payloadLength > end) return false; //Truncated
+
+	const char* payload = file.data() + position + sizeof(CaptureRecordHeader);
+	record.timestamp = std::chrono::nanoseconds(recordHeader.timestamp);
+	record.kind = recordHeader.kind;
+	record.lane = recordHeader.lane;
+	if (version == 1) //Before lanes, everything went through the one async arena
+		record.lane = recordHeader.kind == CaptureRecordKind::Pipelined ? MessageLane::Realtime : MessageLane::Bulk;
+	else if (static_cast<size_t>(record.lane) >= MESSAGE_LANE_COUNT) //Written by a newer version
+		record.lane = MessageLane::Bulk;
+	record.key = std::string_view(payload, recordHeader.keyLength);
+	record.message = std::string_view(payload + recordHeader.keyLength, recordHeader.length);
+	position += (sizeof(CaptureRecordHeader) + payloadLength + TRANSPORT_CAPTURE_RECORD_ALIGN - 1) &
+		~static_cast<uint64_t>(TRANSPORT_CAPTURE_RECORD_ALIGN - 1);
+	return true;
+}
+
+uint64_t TransportCaptureReader::getRecordCount() const {
+	return file.data() ? header()->recordCount : 0;
+}
+
+std::chrono::system_clock::time_point TransportCaptureReader::getStartTime() const {
+	if (!file.data()) return {};
+	return std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(
+		std::chrono::nanoseconds(header()->startTime)));
+}
@@ -0,0 +1,126 @@
+#pragma once
+#ifdef _WIN32
+#include <Windows.h>
+#endif
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+/*
+Capture file layout
+offset 0: CaptureFileHeader [TRANSPORT_CAPTURE_HEADER_SIZE]
+offset 64: records, each [CaptureRecordHeader][key][message] padded to TRANSPORT_CAPTURE_RECORD_ALIGN bytes
+
+Records are appended under a lock, dataEnd in the header is advanced after every complete record.
+So the capture of a game that crashed is still readable up to the last message it sent.
+The file grows in TRANSPORT_CAPTURE_GROW_SIZE steps while capturing and is cut back to dataEnd when the capture stops.
+Record timestamps are steady clock nanoseconds since the capture started, startTime is the wall clock time of that.
+*/
+
+#define TRANSPORT_CAPTURE_MAGIC 0x3150414352414654ull //"TFARCAP1"
+#define TRANSPORT_CAPTURE_VERSION 2 //2 added the lane, version 1 captures replay async messages in Bulk and pipelined ones in Realtime
+#define TRANSPORT_CAPTURE_HEADER_SIZE 64
+#define TRANSPORT_CAPTURE_RECORD_ALIGN 8
+#define TRANSPORT_CAPTURE_GROW_SIZE (64ull * 1024 * 1024)
+
+enum class MessageLane : uint8_t; //Transport.hpp
+
+namespace SharedMemoryHandlerInternal {
+	enum class CaptureRecordKind : uint8_t {
+		Async, //doAsyncRequest and AsyncWriter, key is set for keyed messages
+		Sync, //doSyncRequest, also the sync half of doSyncAndAsyncRequest
+		Pipelined //doPipelinedRequest, without the REQ prefix
+	};
+
+	struct CaptureFileHeader {
+		uint64_t magic;
+		uint32_t version;
+		uint32_t headerSize;
+		int64_t startTime; //system_clock nanoseconds since epoch
+		uint64_t recordCount;
+		std::atomic<uint64_t> dataEnd; //Offset behind the last complete record
+	};
+	static_assert(sizeof(CaptureFileHeader) <= TRANSPORT_CAPTURE_HEADER_SIZE, "CaptureFileHeader is bigger than space allocated to it");
+
+	struct CaptureRecordHeader {
+		uint64_t timestamp; //Nanoseconds since startTime
+		uint32_t length; //Of the message
+		uint16_t keyLength;
+		CaptureRecordKind kind;
+		MessageLane lane; //Of async and pipelined messages
+	};
+	static_assert(sizeof(CaptureRecordHeader) % TRANSPORT_CAPTURE_RECORD_ALIGN == 0, "Records have to stay aligned");
+
+	//A file mapped into memory, platform specific parts are in TransportCapture.cpp
+	class MappedFile {
+	public:
+		MappedFile() = default;
+		~MappedFile() { close(); }
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		bool create(const std::string& path, uint64_t size); //Truncates an existing file
+		bool openReadOnly(const std::string& path);
+		bool resize(uint64_t size); //Remaps, data() changes
+		void close(uint64_t truncateTo = UINT64_MAX);
+		char* data() const { return view; }
+		uint64_t size() const { return mappedSize; }
+		std::string errorMessage;
+	private:
+		bool map(bool writable);
+		void unmap();
+		char* view = nullptr;
+		uint64_t mappedSize = 0;
+#ifdef _WIN32
+		HANDLE hFile = INVALID_HANDLE_VALUE;
+		HANDLE hMapping = nullptr;
+#else
+		int fd = -1;
+#endif
+	};
+
+	//Writing side, shared by every Transport of the process
+	class TransportCapture {
+	public:
+		~TransportCapture() { stop(); }
+		bool start(const std::string& path);
+		void stop();
+		//Cheap enough to check before every message
+		bool isActive() const { return active.load(std::memory_order_relaxed); }
+		//lane only matters for async and pipelined records, sync ones leave it 0
+		void record(CaptureRecordKind kind, std::string_view message, std::string_view key = {}, MessageLane lane = {});
+		std::string errorMessage;
+	private:
+		std::mutex lock;
+		std::atomic<bool> active{ false };
+		MappedFile file;
+		std::chrono::steady_clock::time_point startTime;
+	};
+
+	class TransportCaptureReader {
+	public:
+		struct Record {
+			std::chrono::nanoseconds timestamp;
+			CaptureRecordKind kind;
+			MessageLane lane;
+			std::string_view key;
+			std::string_view message; //Points into the mapping, valid until close
+		};
+
+		bool open(const std::string& path);
+		void close() { file.close(); }
+		bool next(Record& record); //false at the end of the capture
+		void rewind() { position = TRANSPORT_CAPTURE_HEADER_SIZE; }
+		uint64_t getRecordCount() const;
+		std::chrono::system_clock::time_point getStartTime() const;
+		std::string errorMessage;
+	private:
+		const CaptureFileHeader* header() const { return reinterpret_cast<const CaptureFileHeader*>(file.data()); }
+		MappedFile file;
+		uint32_t version = 0;
+		uint64_t position = TRANSPORT_CAPTURE_HEADER_SIZE;
+	};
+}
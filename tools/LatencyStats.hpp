@@ -0,0 +1,17 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+//Shared by the transport tools, prints percentiles of round trip samples
+inline void printLatency(const char* name, std::vector<std::chrono::nanoseconds>& samples) {
+	if (samples.empty()) return;
+	std::sort(samples.begin(), samples.end());
+	auto percentile = [&samples](double p) {
+		auto index = static_cast<size_t>(p * (samples.size() - 1));
+		return std::chrono::duration<double, std::micro>(samples[index]).count();
+	};
+	printf("%-10s latency us: p50 %.1f  p99 %.1f  p999 %.1f  max %.1f  (%zu samples)\n",
+		name, percentile(0.5), percentile(0.99), percentile(0.999), percentile(1.0), samples.size());
+}
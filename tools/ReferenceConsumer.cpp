@@ -0,0 +1,216 @@
+#include "ReferenceConsumer.hpp"
+#include "ReferencePipeConsumer.hpp"
+#include "MessageCompression.hpp"
+#include <charconv>
+#include <cstring>
+#include <new>
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+using namespace SharedMemoryHandlerInternal;
+using namespace std::string_literals;
+using namespace std::string_view_literals;
+
+static uint32_t makeSessionGeneration() {
+	//Only has to differ from the previous session, clock ticks are good enough
+	auto generation = static_cast<uint32_t>(std::chrono::system_clock::now().time_since_epoch().count());
+	return generation ? generation : 1;
+}
+
+std::unique_ptr<ReferenceConsumer> ReferenceConsumer::create(std::string_view transport, uint32_t capabilities) {
+	if (transport == "shm"sv)
+		return std::make_unique<ReferenceSharedMemoryConsumer>(capabilities);
+	if (transport == "pipe"sv)
+		return std::make_unique<ReferencePipeConsumer>(capabilities);
+	return nullptr;
+}
+
+ReferenceConsumer::ReferenceConsumer(uint32_t _capabilities) : capabilities(_capabilities) {
+	answerFunc = [](std::string_view request) { return std::string(request); };
+}
+
+ReferenceSharedMemoryConsumer::~ReferenceSharedMemoryConsumer() {
+	release();
+}
+
+#ifdef _WIN32
+bool ReferenceSharedMemoryConsumer::create() {
+	hEventRequest = CreateEventW(nullptr, TRUE, FALSE, L"Local\\TFARSHAMEM_EVTREQ");
+	hEventResponse = CreateEventW(nullptr, TRUE, FALSE, L"Local\\TFARSHAMEM_EVTRESP");
+	hMutex = CreateMutexW(nullptr, FALSE, L"Local\\TFARSHAMEM_MTX");
+	if (!hEventRequest || !hEventResponse || !hMutex) {
+		errorMessage = "CreateEvent/CreateMutex failed " + std::to_string(GetLastError());
+		return false;
+	}
+	hMapFile = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, SHAREDMEM_BUFSIZE, L"Local\\TFARSHAMEM");
+	if (!hMapFile) {
+		errorMessage = "CreateFileMapping failed " + std::to_string(GetLastError());
+		return false;
+	}
+	auto view = MapViewOfFile(hMapFile, FILE_MAP_WRITE, 0, 0, SHAREDMEM_BUFSIZE);
+	if (!view) {
+		errorMessage = "MapViewOfFile failed " + std::to_string(GetLastError());
+		return false;
+	}
+	memset(view, 0, SHAREDMEM_BUFSIZE);
+	pData = new (view) SharedMemoryData(SHAREDMEM_BUFSIZE, makeSessionGeneration());
+	pData->setConsumerCapabilities(capabilities);
+	pData->setLastPluginTick();
+	return true;
+}
+
+void ReferenceSharedMemoryConsumer::release() {
+	if (pData) UnmapViewOfFile(pData);
+	if (hMapFile) CloseHandle(hMapFile);
+	if (hEventRequest) CloseHandle(hEventRequest);
+	if (hEventResponse) CloseHandle(hEventResponse);
+	if (hMutex) CloseHandle(hMutex);
+	pData = nullptr;
+	hMapFile = hEventRequest = hEventResponse = hMutex = nullptr;
+}
+#else
+bool ReferenceSharedMemoryConsumer::create() {
+	//Start from scratch, a crashed consumer might have left stale objects behind
+	shm_unlink(SHAREDMEM_POSIX_SYNC_NAME);
+	shm_unlink(SHAREDMEM_POSIX_NAME);
+
+	syncFd = shm_open(SHAREDMEM_POSIX_SYNC_NAME, O_RDWR | O_CREAT, 0600);
+	if (syncFd == -1 || ftruncate(syncFd, sizeof(PosixSyncBlock)) == -1) {
+		errorMessage = "sync shm_open failed "s + strerror(errno);
+		return false;
+	}
+	auto syncView = mmap(nullptr, sizeof(PosixSyncBlock), PROT_READ | PROT_WRITE, MAP_SHARED, syncFd, 0);
+	if (syncView == MAP_FAILED) {
+		errorMessage = "sync mmap failed "s + strerror(errno);
+		return false;
+	}
+	pSyncBlock = new (syncView) PosixSyncBlock();
+	hEventRequest = &pSyncBlock->eventRequest;
+	hEventResponse = &pSyncBlock->eventResponse;
+	hMutex = &pSyncBlock->mutex;
+
+	//The game only opens it and checks the size, so it has to be fully sized before it becomes usable
+	shmFd = shm_open(SHAREDMEM_POSIX_NAME, O_RDWR | O_CREAT, 0600);
+	if (shmFd == -1 || ftruncate(shmFd, SHAREDMEM_BUFSIZE) == -1) {
+		errorMessage = "shm_open failed "s + strerror(errno);
+		return false;
+	}
+	auto view = mmap(nullptr, SHAREDMEM_BUFSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shmFd, 0);
+	if (view == MAP_FAILED) {
+		errorMessage = "mmap failed "s + strerror(errno);
+		return false;
+	}
+	pData = new (view) SharedMemoryData(SHAREDMEM_BUFSIZE, makeSessionGeneration()); //Fresh shm is zero filled, arenas start out empty
+	pData->setConsumerCapabilities(capabilities);
+	pData->setLastPluginTick();
+	return true;
+}
+
+void ReferenceSharedMemoryConsumer::release() {
+	if (pData) munmap(pData, SHAREDMEM_BUFSIZE);
+	if (shmFd != -1) close(shmFd);
+	if (pSyncBlock) munmap(pSyncBlock, sizeof(PosixSyncBlock));
+	if (syncFd != -1) close(syncFd);
+	if (pData || pSyncBlock) {
+		shm_unlink(SHAREDMEM_POSIX_NAME);
+		shm_unlink(SHAREDMEM_POSIX_SYNC_NAME);
+	}
+	pData = nullptr;
+	pSyncBlock = nullptr;
+	hEventRequest = hEventResponse = nullptr;
+	hMutex = nullptr;
+	shmFd = syncFd = -1;
+}
+#endif
+
+void ReferenceConsumer::handleAsyncMessage(std::string_view message) {
+	receivedBytes += message.length();
+	if (message.substr(0, 4) == "CMP\t"sv) {
+		message.remove_prefix(4);
+		const auto separator = message.find('\t');
+		size_t originalLength = 0;
+		if (separator == std::string_view::npos ||
+			std::from_chars(message.data(), message.data() + separator, originalLength).ec != std::errc() ||
+			originalLength / 255 > message.length()) //More than any LZ block can expand to, don't allocate for it
+			return;
+		if (!decompressMessage(message.substr(separator + 1), originalLength, decompressed))
+			return; //Corrupt, a pipelined request in it times out on the game side
+		message = decompressed;
+	}
+
+	MessageStamp stamp;
+	if ((getNegotiatedCapabilities() & static_cast<uint32_t>(TransportCapability::MessageTimestamps)) && readMessageStamp(message, stamp))
+		addConsumed(stamp, stampClockNow());
+
+	if (message.substr(0, 4) != "REQ\t"sv) {
+		++asyncCount;
+		if (messageFunc) messageFunc(message);
+		return;
+	}
+
+	message.remove_prefix(4);
+	const auto separator = message.find('\t');
+	uint32_t requestID = 0;
+	if (separator == std::string_view::npos ||
+		std::from_chars(message.data(), message.data() + separator, requestID).ec != std::errc())
+		return; //Malformed, the game times it out
+	++pipelinedCount;
+	addCompletion(requestID, answerFunc(message.substr(separator + 1)));
+}
+
+std::string ReferenceConsumer::answerSyncRequest(std::string_view request) {
+	receivedBytes += request.length();
+	++syncCount;
+	return answerFunc(request);
+}
+
+void ReferenceSharedMemoryConsumer::addCompletion(uint32_t requestID, const std::string& answer) {
+	//The completion arena is big, but if the game stops draining it the request just times out on its side
+	pData->addCompletion(requestID, answer);
+	completionsWritten = true;
+}
+
+void ReferenceSharedMemoryConsumer::addConsumed(const MessageStamp& stamp, uint64_t consumeTime) {
+	pData->getConsumerTelemetry()->countConsumed(stamp, consumeTime);
+}
+
+bool ReferenceSharedMemoryConsumer::processPending() {
+	if (!pData) return false;
+	bool didWork = false;
+	pData->setLastPluginTick();
+
+	//Async first, doSyncAndAsyncRequest relies on its async part being handled before the sync part
+	std::string message;
+	while (pData->popAsyncRequest(message)) {
+		handleAsyncMessage(message);
+		didWork = true;
+	}
+
+	std::string request;
+	MutexLock lock(hMutex);
+	if (lock.isLocked() && pData->getSyncRequest(request)) {
+		lock.unlock();
+		pData->setSyncResponse(answerSyncRequest(request));
+		signalEvent(hEventResponse);
+		didWork = true;
+	}
+	lock.unlock();
+
+	if (completionsWritten) {
+		signalEvent(hEventResponse);
+		completionsWritten = false;
+	}
+	return didWork;
+}
+
+void ReferenceSharedMemoryConsumer::run(const std::atomic<bool>& stop) {
+	while (!stop) {
+		//Reset before looking, a request that comes in while we are busy sets it again
+		waitEvent(hEventRequest, 10);
+		resetEvent(hEventRequest);
+		while (processPending()) {}
+	}
+}
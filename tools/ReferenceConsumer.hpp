@@ -0,0 +1,103 @@
+#pragma once
+#include "SharedMemoryTransfer.hpp"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+/*
+Stand-in for the TeamSpeak half of a transport. Handles what every transport carries the same way: plain async messages,
+"CMP" records that it decompresses, "TS" stamps it strips and reports as consumed, and pipelined "REQ\t<id>\t<request>"
+records it answers with completions.
+How the bytes arrive and how answers go back is up to ReferenceSharedMemoryConsumer and ReferencePipeConsumer.
+*/
+class ReferenceConsumer {
+public:
+	using AnswerFunc = std::function<std::string(std::string_view request)>;
+	using MessageFunc = std::function<void(std::string_view message)>;
+
+	static constexpr uint32_t defaultCapabilities = static_cast<uint32_t>(TransportCapability::SyncResponseSequence) |
+		static_cast<uint32_t>(TransportCapability::PipelinedRequests) |
+		static_cast<uint32_t>(TransportCapability::CompressedMessages) |
+		static_cast<uint32_t>(TransportCapability::MessageTimestamps);
+
+	//"shm" or "pipe", nullptr for anything else
+	static std::unique_ptr<ReferenceConsumer> create(std::string_view transport, uint32_t capabilities = defaultCapabilities);
+
+	virtual ~ReferenceConsumer() = default;
+	ReferenceConsumer(const ReferenceConsumer&) = delete;
+	ReferenceConsumer& operator=(const ReferenceConsumer&) = delete;
+
+	virtual bool create() = 0;
+	//Handles everything that is there, returns false if there was nothing
+	virtual bool processPending() = 0;
+	virtual void run(const std::atomic<bool>& stop) = 0;
+
+	//Sync and pipelined requests. Default echoes the request back
+	void setAnswerHandler(AnswerFunc func) { answerFunc = std::move(func); }
+	//Plain async messages. Default ignores them
+	void setMessageHandler(MessageFunc func) { messageFunc = std::move(func); }
+
+	uint64_t getAsyncCount() const { return asyncCount; }
+	uint64_t getSyncCount() const { return syncCount; }
+	uint64_t getPipelinedCount() const { return pipelinedCount; }
+	uint64_t getReceivedBytes() const { return receivedBytes; }
+	//What the game decided to use, TransportCapability bits both sides support
+	virtual uint32_t getNegotiatedCapabilities() const = 0;
+
+	std::string errorMessage;
+protected:
+	explicit ReferenceConsumer(uint32_t capabilities);
+	void handleAsyncMessage(std::string_view message);
+	std::string answerSyncRequest(std::string_view request);
+	virtual void addCompletion(uint32_t requestID, const std::string& answer) = 0;
+	//A stamped message was handled, consumeTime in steady_clock microseconds
+	virtual void addConsumed(const SharedMemoryHandlerInternal::MessageStamp& stamp, uint64_t consumeTime) = 0;
+
+	uint32_t capabilities;
+	AnswerFunc answerFunc;
+	MessageFunc messageFunc;
+
+	std::atomic<uint64_t> asyncCount{ 0 };
+	std::atomic<uint64_t> syncCount{ 0 };
+	std::atomic<uint64_t> pipelinedCount{ 0 };
+	std::atomic<uint64_t> receivedBytes{ 0 };
+	std::string decompressed; //Of the current "CMP" record
+};
+
+/*
+Creates the memory region, events and mutex with the names and layout SharedMemoryHandler expects, drains the async arena,
+answers sync requests through the sync slot and pipelined requests through the completion arena.
+Like TeamSpeak it signals the response event after every answer and keeps lastPluginTick fresh.
+*/
+class ReferenceSharedMemoryConsumer : public ReferenceConsumer {
+public:
+	explicit ReferenceSharedMemoryConsumer(uint32_t capabilities = defaultCapabilities) : ReferenceConsumer(capabilities) {}
+	~ReferenceSharedMemoryConsumer() override;
+
+	bool create() override;
+	bool processPending() override;
+	void run(const std::atomic<bool>& stop) override;
+	uint32_t getNegotiatedCapabilities() const override { return pData ? pData->getNegotiatedCapabilities() : 0; }
+protected:
+	void addCompletion(uint32_t requestID, const std::string& answer) override;
+	void addConsumed(const SharedMemoryHandlerInternal::MessageStamp& stamp, uint64_t consumeTime) override;
+private:
+	void release();
+
+	bool completionsWritten = false;
+
+#ifdef _WIN32
+	HANDLE hMapFile = nullptr;
+#else
+	int shmFd = -1;
+	int syncFd = -1;
+	SharedMemoryHandlerInternal::PosixSyncBlock* pSyncBlock = nullptr;
+#endif
+	SharedMemoryHandlerInternal::EventHandle hEventRequest = nullptr;
+	SharedMemoryHandlerInternal::EventHandle hEventResponse = nullptr;
+	SharedMemoryHandlerInternal::MutexHandle hMutex = nullptr;
+	SharedMemoryHandlerInternal::SharedMemoryData* pData = nullptr;
+};
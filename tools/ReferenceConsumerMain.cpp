@@ -0,0 +1,58 @@
+#include "ReferenceConsumer.hpp"
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+//Runs the reference consumer until interrupted, so a real game or tfar_transport_benchmark --external can talk to it
+
+static std::atomic<bool> stopRequested{ false };
+
+static void onSignal(int) {
+	stopRequested = true;
+}
+
+int main(int argc, char* argv[]) {
+	uint32_t capabilities = ReferenceConsumer::defaultCapabilities;
+	const char* transport = "shm";
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--capabilities") == 0 && i + 1 < argc) {
+			capabilities = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 0));
+		} else if (strcmp(argv[i], "--transport") == 0 && i + 1 < argc) {
+			transport = argv[++i];
+		} else {
+			fprintf(stderr, "usage: %s [--capabilities <TransportCapability bits>] [--transport shm|pipe]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	auto consumer = ReferenceConsumer::create(transport, capabilities);
+	if (!consumer) {
+		fprintf(stderr, "unknown transport %s\n", transport);
+		return 1;
+	}
+	if (!consumer->create()) {
+		fprintf(stderr, "%s\n", consumer->errorMessage.c_str());
+		return 1;
+	}
+	signal(SIGINT, onSignal);
+	signal(SIGTERM, onSignal);
+
+	std::atomic<bool> stopConsumer{ false };
+	std::thread worker([&consumer, &stopConsumer]() { consumer->run(stopConsumer); });
+
+	printf("%s consumer running, capabilities 0x%x\n", transport, capabilities);
+	while (!stopRequested) {
+		std::this_thread::sleep_for(std::chrono::seconds(5));
+		printf("async %llu sync %llu pipelined %llu bytes %llu negotiated 0x%x\n",
+			static_cast<unsigned long long>(consumer->getAsyncCount()),
+			static_cast<unsigned long long>(consumer->getSyncCount()),
+			static_cast<unsigned long long>(consumer->getPipelinedCount()),
+			static_cast<unsigned long long>(consumer->getReceivedBytes()),
+			consumer->getNegotiatedCapabilities());
+	}
+	stopConsumer = true;
+	worker.join();
+	return 0;
+}
@@ -0,0 +1,278 @@
+#include "ReferencePipeConsumer.hpp"
+#include <algorithm>
+#include <cstring>
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#endif
+using namespace SharedMemoryHandlerInternal;
+using namespace std::string_literals;
+
+ReferencePipeConsumer::ReferencePipeConsumer(uint32_t _capabilities, std::string _path) : ReferenceConsumer(_capabilities), path(std::move(_path)) {}
+
+ReferencePipeConsumer::~ReferencePipeConsumer() {
+	release();
+}
+
+bool ReferencePipeConsumer::processPending() {
+	acceptClients();
+	bool didWork = false;
+	for (auto& client : clients)
+		didWork |= handleClient(*client);
+
+	clients.erase(std::remove_if(clients.begin(), clients.end(), [this](const std::unique_ptr<Client>& client) {
+		if (!client->broken) return false;
+		closeClient(*client);
+		return true;
+	}), clients.end());
+	return didWork;
+}
+
+bool ReferencePipeConsumer::handleClient(Client& client) {
+	bool didWork = false;
+	while (!client.broken) {
+		size_t space;
+		char* target = client.reader.prepare(space);
+		size_t read;
+		if (!readSome(client, target, space, read)) {
+			client.broken = true;
+			break;
+		}
+		if (read == 0) break;
+		client.reader.commit(read);
+		didWork = true;
+
+		PipeFrameHeader header;
+		std::string_view payload;
+		while (client.reader.next(header, payload))
+			handleFrame(client, header, payload);
+		if (!client.consumedRecords.empty()) {
+			appendPipeFrame(client.sendBuffer, PipeFrameKind::Consumed, 0, client.consumedRecords);
+			client.consumedRecords.clear();
+		}
+		if (client.reader.isCorrupt())
+			client.broken = true;
+	}
+	flushClient(client);
+	return didWork;
+}
+
+void ReferencePipeConsumer::handleFrame(Client& client, const PipeFrameHeader& header, std::string_view payload) {
+	switch (header.kind) {
+		case PipeFrameKind::Hello: {
+			uint32_t producerCapabilities = 0;
+			memcpy(&producerCapabilities, payload.data(), (std::min)(payload.length(), sizeof(producerCapabilities)));
+			negotiatedCapabilities = producerCapabilities & capabilities;
+			appendPipeFrame(client.sendBuffer, PipeFrameKind::Hello, 0,
+				std::string_view(reinterpret_cast<const char*>(&capabilities), sizeof(capabilities)));
+			break;
+		}
+		case PipeFrameKind::Async:
+			currentClient = &client;
+			handleAsyncMessage(payload);
+			currentClient = nullptr;
+			break;
+		case PipeFrameKind::Sync:
+			appendPipeFrame(client.sendBuffer, PipeFrameKind::SyncAnswer, header.sequence, answerSyncRequest(payload));
+			break;
+		default: //Skipped, Shutdown
+			break;
+	}
+}
+
+void ReferencePipeConsumer::addCompletion(uint32_t requestID, const std::string& answer) {
+	const auto completion = std::to_string(requestID) + '\t' + answer;
+	appendPipeFrame(currentClient->sendBuffer, PipeFrameKind::Completion, 0, completion);
+}
+
+void ReferencePipeConsumer::addConsumed(const MessageStamp& stamp, uint64_t consumeTime) {
+	PipeConsumedRecord record{};
+	record.lane = static_cast<uint8_t>(stamp.lane);
+	record.captureTime = stamp.captureTime;
+	record.enqueueTime = stamp.enqueueTime;
+	record.consumeTime = consumeTime;
+	currentClient->consumedRecords.append(reinterpret_cast<const char*>(&record), sizeof(record));
+}
+
+void ReferencePipeConsumer::flushClient(Client& client) {
+	while (!client.broken && client.sendBufferHead < client.sendBuffer.size()) {
+		size_t written;
+		if (!writeSome(client, client.sendBuffer.data() + client.sendBufferHead, client.sendBuffer.size() - client.sendBufferHead, written))
+			client.broken = true;
+		else if (written == 0)
+			break; //Game doesn't read right now, keep it for the next round
+		else
+			client.sendBufferHead += written;
+	}
+	if (client.sendBufferHead == client.sendBuffer.size()) {
+		client.sendBuffer.clear();
+		client.sendBufferHead = 0;
+	}
+}
+
+void ReferencePipeConsumer::run(const std::atomic<bool>& stop) {
+	while (!stop) {
+		if (!processPending())
+			waitForActivity(10ms);
+	}
+}
+
+#ifdef _WIN32
+static HANDLE createPipeInstance(const std::string& path) {
+	const DWORD mode = PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_NOWAIT;
+	if (path.empty())
+		return CreateNamedPipeW(PIPE_NAME, PIPE_ACCESS_DUPLEX, mode, PIPE_UNLIMITED_INSTANCES, PIPE_SEND_BUFFER_SIZE, PIPE_SEND_BUFFER_SIZE, 0, nullptr);
+	return CreateNamedPipeA(path.c_str(), PIPE_ACCESS_DUPLEX, mode, PIPE_UNLIMITED_INSTANCES, PIPE_SEND_BUFFER_SIZE, PIPE_SEND_BUFFER_SIZE, 0, nullptr);
+}
+
+bool ReferencePipeConsumer::create() {
+	hListeningPipe = createPipeInstance(path);
+	if (hListeningPipe == INVALID_HANDLE_VALUE) {
+		errorMessage = "CreateNamedPipe failed " + std::to_string(GetLastError());
+		return false;
+	}
+	return true;
+}
+
+void ReferencePipeConsumer::acceptClients() {
+	while (hListeningPipe != INVALID_HANDLE_VALUE) {
+		//Nonblocking instance, returns right away
+		if (!ConnectNamedPipe(hListeningPipe, nullptr)) {
+			const auto error = GetLastError();
+			if (error == ERROR_NO_DATA) { //Connected and already gone again
+				DisconnectNamedPipe(hListeningPipe);
+				continue;
+			}
+			if (error != ERROR_PIPE_CONNECTED) return; //ERROR_PIPE_LISTENING, nobody there
+		}
+		auto client = std::make_unique<Client>();
+		client->hPipe = hListeningPipe;
+		clients.emplace_back(std::move(client));
+		hListeningPipe = createPipeInstance(path);
+	}
+}
+
+void ReferencePipeConsumer::closeClient(Client& client) {
+	DisconnectNamedPipe(client.hPipe);
+	CloseHandle(client.hPipe);
+	client.hPipe = INVALID_HANDLE_VALUE;
+}
+
+void ReferencePipeConsumer::release() {
+	for (auto& client : clients)
+		closeClient(*client);
+	clients.clear();
+	if (hListeningPipe != INVALID_HANDLE_VALUE) CloseHandle(hListeningPipe);
+	hListeningPipe = INVALID_HANDLE_VALUE;
+}
+
+bool ReferencePipeConsumer::readSome(Client& client, char* data, size_t length, size_t& read) {
+	read = 0;
+	DWORD bytesRead = 0;
+	if (!ReadFile(client.hPipe, data, static_cast<DWORD>((std::min)(length, size_t(64 * 1024))), &bytesRead, nullptr))
+		return GetLastError() == ERROR_NO_DATA;
+	read = bytesRead;
+	return true;
+}
+
+bool ReferencePipeConsumer::writeSome(Client& client, const char* data, size_t length, size_t& written) {
+	DWORD bytesWritten = 0;
+	if (!WriteFile(client.hPipe, data, static_cast<DWORD>((std::min)(length, size_t(64 * 1024))), &bytesWritten, nullptr)) {
+		written = 0;
+		return false;
+	}
+	written = bytesWritten;
+	return true;
+}
+
+void ReferencePipeConsumer::waitForActivity(std::chrono::milliseconds) {
+	Sleep(1); //Nonblocking pipes can't be waited on, TeamSpeak polls on its timer as well
+}
+#else
+bool ReferencePipeConsumer::create() {
+	const std::string socketPath = path.empty() ? std::string(PIPE_POSIX_PATH) : path;
+	sockaddr_un address{};
+	address.sun_family = AF_UNIX;
+	if (socketPath.length() >= sizeof(address.sun_path)) {
+		errorMessage = "socket path too long";
+		return false;
+	}
+	memcpy(address.sun_path, socketPath.c_str(), socketPath.length() + 1);
+
+	unlink(socketPath.c_str()); //Left behind by a crashed consumer
+	listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenFd == -1 || bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1 || ::listen(listenFd, 8) == -1) {
+		errorMessage = "listen failed "s + strerror(errno);
+		return false;
+	}
+	fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+	return true;
+}
+
+void ReferencePipeConsumer::acceptClients() {
+	if (listenFd == -1) return;
+	while (true) {
+		const int socketFd = accept(listenFd, nullptr, nullptr);
+		if (socketFd == -1) return;
+		fcntl(socketFd, F_SETFL, fcntl(socketFd, F_GETFL) | O_NONBLOCK);
+#ifdef SO_NOSIGPIPE
+		int noSigPipe = 1;
+		setsockopt(socketFd, SOL_SOCKET, SO_NOSIGPIPE, &noSigPipe, sizeof(noSigPipe));
+#endif
+		auto client = std::make_unique<Client>();
+		client->socketFd = socketFd;
+		clients.emplace_back(std::move(client));
+	}
+}
+
+void ReferencePipeConsumer::closeClient(Client& client) {
+	close(client.socketFd);
+	client.socketFd = -1;
+}
+
+void ReferencePipeConsumer::release() {
+	for (auto& client : clients)
+		closeClient(*client);
+	clients.clear();
+	if (listenFd == -1) return;
+	close(listenFd);
+	listenFd = -1;
+	unlink(path.empty() ? PIPE_POSIX_PATH : path.c_str());
+}
+
+bool ReferencePipeConsumer::readSome(Client& client, char* data, size_t length, size_t& read) {
+	read = 0;
+	const auto result = recv(client.socketFd, data, length, 0);
+	if (result > 0) {
+		read = static_cast<size_t>(result);
+		return true;
+	}
+	if (result == 0) return false; //Game closed it
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+bool ReferencePipeConsumer::writeSome(Client& client, const char* data, size_t length, size_t& written) {
+	written = 0;
+	const auto result = send(client.socketFd, data, length, MSG_NOSIGNAL);
+	if (result >= 0) {
+		written = static_cast<size_t>(result);
+		return true;
+	}
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+void ReferencePipeConsumer::waitForActivity(std::chrono::milliseconds timeout) {
+	std::vector<pollfd> descriptors;
+	descriptors.push_back({ listenFd, POLLIN, 0 });
+	for (auto& client : clients) //Also wake up when a full socket drains, answers are waiting
+		descriptors.push_back({ client->socketFd, static_cast<short>(POLLIN | (client->sendBuffer.empty() ? 0 : POLLOUT)), 0 });
+	poll(descriptors.data(), descriptors.size(), static_cast<int>(timeout.count()));
+}
+#endif
@@ -0,0 +1,61 @@
+#pragma once
+#include "PipeTransport.hpp"
+#include "ReferenceConsumer.hpp"
+#include <memory>
+#include <vector>
+
+/*
+Stand-in for the TeamSpeak half of PipeTransport. Listens on the named pipe PIPE_NAME (Windows) or the Unix domain socket
+PIPE_POSIX_PATH, accepts any number of games, answers Hello with its capabilities, Sync frames with a SyncAnswer and
+pipelined requests with Completion frames on the connection they came from. Stamps of one read go back in one Consumed frame. Never blocks on a slow game, answers are
+buffered per connection.
+*/
+class ReferencePipeConsumer : public ReferenceConsumer {
+public:
+	explicit ReferencePipeConsumer(uint32_t capabilities = defaultCapabilities, std::string path = {});
+	~ReferencePipeConsumer() override;
+
+	bool create() override;
+	bool processPending() override;
+	void run(const std::atomic<bool>& stop) override;
+	uint32_t getNegotiatedCapabilities() const override { return negotiatedCapabilities; } //Of the newest connection
+protected:
+	void addCompletion(uint32_t requestID, const std::string& answer) override;
+	void addConsumed(const SharedMemoryHandlerInternal::MessageStamp& stamp, uint64_t consumeTime) override;
+private:
+	struct Client {
+#ifdef _WIN32
+		HANDLE hPipe = INVALID_HANDLE_VALUE;
+#else
+		int socketFd = -1;
+#endif
+		SharedMemoryHandlerInternal::PipeFrameReader reader;
+		std::vector<char> sendBuffer;
+		std::string consumedRecords; //PipeConsumedRecord of what was handled since the last Consumed frame
+		size_t sendBufferHead = 0;
+		bool broken = false;
+	};
+
+	bool handleClient(Client& client); //true if it did anything
+	void handleFrame(Client& client, const SharedMemoryHandlerInternal::PipeFrameHeader& header, std::string_view payload);
+	void flushClient(Client& client);
+
+	//Platform specific
+	bool listen();
+	void acceptClients();
+	void closeClient(Client& client);
+	void release();
+	bool readSome(Client& client, char* data, size_t length, size_t& read);
+	bool writeSome(Client& client, const char* data, size_t length, size_t& written);
+	void waitForActivity(std::chrono::milliseconds timeout);
+
+	std::string path;
+#ifdef _WIN32
+	HANDLE hListeningPipe = INVALID_HANDLE_VALUE; //Instance the next game connects to
+#else
+	int listenFd = -1;
+#endif
+	std::vector<std::unique_ptr<Client>> clients;
+	Client* currentClient = nullptr; //Where completions go
+	std::atomic<uint32_t> negotiatedCapabilities{ 0 };
+};
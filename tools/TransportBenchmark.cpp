@@ -0,0 +1,234 @@
+#include "LatencyStats.hpp"
+#include "PipeTransport.hpp"
+#include "ReferenceConsumer.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+
+/*
+Drives SharedMemoryHandler or PipeTransport with a configurable mix of traffic against the matching reference consumer.
+Round trip latency is measured for sync requests (doSyncRequest) and pipelined requests (send until callback).
+Async messages have no answer, they only count towards throughput. A full arena is retried, that is backpressure.
+*/
+
+struct BenchmarkConfig {
+	uint64_t messages = 100000;
+	double syncRatio = 0.1;
+	double pipelinedRatio = 0.0;
+	size_t payloadSize = 64;
+	uint32_t capabilities = ReferenceConsumer::defaultCapabilities;
+	std::string transport = "shm"; //"shm" or "pipe"
+	uint32_t mapping = SHAREDMEM_DEFAULT_MAPPING; //MemMapMode bits for shm
+	bool external = false; //Consumer is a separate tfar_reference_consumer process
+	std::string capturePath; //Record the generated traffic for tfar_transport_replay
+};
+
+static void printUsage(const char* name) {
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  --messages <n>        total messages to send (100000)\n"
+		"  --sync <ratio>        share of sync requests, 0..1 (0.1)\n"
+		"  --pipelined <ratio>   share of pipelined requests, 0..1 (0)\n"
+		"  --size <bytes>        payload size of every message (64)\n"
+		"  --capabilities <bits> TransportCapability bits the in process consumer announces (60)\n"
+		"  --transport <name>    shm or pipe (shm)\n"
+		"  --mapping <mode>      lazy, prefault or lock, how shm is mapped (prefault)\n"
+		"  --external            don't start a consumer, use a running tfar_reference_consumer\n"
+		"  --capture <file>      record the generated traffic\n", name);
+}
+
+static bool parseArguments(int argc, char* argv[], BenchmarkConfig& config) {
+	for (int i = 1; i < argc; ++i) {
+		const bool hasValue = i + 1 < argc;
+		if (strcmp(argv[i], "--messages") == 0 && hasValue) config.messages = strtoull(argv[++i], nullptr, 10);
+		else if (strcmp(argv[i], "--sync") == 0 && hasValue) config.syncRatio = atof(argv[++i]);
+		else if (strcmp(argv[i], "--pipelined") == 0 && hasValue) config.pipelinedRatio = atof(argv[++i]);
+		else if (strcmp(argv[i], "--size") == 0 && hasValue) config.payloadSize = strtoull(argv[++i], nullptr, 10);
+		else if (strcmp(argv[i], "--capabilities") == 0 && hasValue) config.capabilities = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 0));
+		else if (strcmp(argv[i], "--transport") == 0 && hasValue) config.transport = argv[++i];
+		else if (strcmp(argv[i], "--mapping") == 0 && hasValue) {
+			if (!SharedMemoryHandlerInternal::parseMemMapMode(argv[++i], config.mapping)) return false;
+		}
+		else if (strcmp(argv[i], "--external") == 0) config.external = true;
+		else if (strcmp(argv[i], "--capture") == 0 && hasValue) config.capturePath = argv[++i];
+		else return false;
+	}
+	return config.syncRatio + config.pipelinedRatio <= 1.0 && (config.transport == "shm" || config.transport == "pipe");
+}
+
+//Looks like a SPEAKERS frame, so compression does about what it does in game. A constant fill would compress to nothing
+static std::string makePayload(size_t size, std::mt19937& random) {
+	std::uniform_int_distribution<int> digit(0, 9);
+	std::string payload;
+	auto appendDigits = [&](int count) {
+		for (int i = 0; i < count; ++i)
+			payload += static_cast<char>('0' + digit(random));
+	};
+	while (payload.length() < size) {
+		payload += "2:";
+		appendDigits(4);
+		payload += "\tPlayer ";
+		appendDigits(2);
+		payload += "\tON\t[";
+		for (int i = 0; i < 3; ++i) {
+			appendDigits(3);
+			payload += '.';
+			appendDigits(1);
+			payload += i < 2 ? ',' : ']';
+		}
+		payload += "\t87.1\tdefault\n";
+	}
+	payload.resize(size);
+	return payload;
+}
+
+int main(int argc, char* argv[]) {
+	BenchmarkConfig config;
+	if (!parseArguments(argc, argv, config)) {
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	auto consumer = ReferenceConsumer::create(config.transport, config.capabilities);
+	std::atomic<bool> stopConsumer{ false };
+	std::thread consumerThread;
+	if (!config.external) {
+		if (!consumer->create()) {
+			fprintf(stderr, "%s\n", consumer->errorMessage.c_str());
+			return 1;
+		}
+		consumerThread = std::thread([&consumer, &stopConsumer]() { consumer->run(stopConsumer); });
+	}
+
+	auto stopConsumerThread = [&stopConsumer, &consumerThread]() {
+		stopConsumer = true;
+		if (consumerThread.joinable())
+			consumerThread.join();
+	};
+
+	std::unique_ptr<Transport> transport;
+	if (config.transport == "pipe")
+		transport = std::make_unique<PipeTransport>();
+	else
+		transport = std::make_unique<SharedMemoryHandler>(config.mapping);
+	Transport& handler = *transport;
+	if (!handler.isReady()) {
+		fprintf(stderr, "Can't connect over %s %s\n", config.transport.c_str(), handler.errorMessage.c_str());
+		stopConsumerThread();
+		return 1;
+	}
+
+	if (config.pipelinedRatio > 0.0 && !handler.isCapabilityActive(TransportCapability::PipelinedRequests)) {
+		fprintf(stderr, "Consumer doesn't support pipelined requests\n");
+		stopConsumerThread();
+		return 1;
+	}
+
+	std::string captureError;
+	if (!config.capturePath.empty() && !Transport::startCapture(config.capturePath, captureError)) {
+		fprintf(stderr, "%s\n", captureError.c_str());
+		return 1;
+	}
+
+	std::mt19937 random(1234);
+	const std::string payload = makePayload(config.payloadSize, random);
+	std::uniform_real_distribution<double> pick(0.0, 1.0);
+
+	std::vector<std::chrono::nanoseconds> syncLatency;
+	std::vector<std::chrono::nanoseconds> pipelinedLatency;
+	syncLatency.reserve(static_cast<size_t>(config.messages * config.syncRatio) + 1);
+	pipelinedLatency.reserve(static_cast<size_t>(config.messages * config.pipelinedRatio) + 1);
+	uint64_t failed = 0;
+	uint64_t arenaFullRetries = 0;
+	std::string answer;
+
+	const auto start = std::chrono::steady_clock::now();
+	for (uint64_t i = 0; i < config.messages; ++i) {
+		const auto kind = pick(random);
+		if (kind < config.syncRatio) {
+			const auto sendTime = std::chrono::steady_clock::now();
+			if (handler.doSyncRequest(payload, answer) && answer == payload)
+				syncLatency.emplace_back(std::chrono::steady_clock::now() - sendTime);
+			else
+				++failed;
+		} else if (kind < config.syncRatio + config.pipelinedRatio) {
+			const auto sendTime = std::chrono::steady_clock::now();
+			auto callback = [&pipelinedLatency, &failed, sendTime](bool success, std::string_view) {
+				if (success)
+					pipelinedLatency.emplace_back(std::chrono::steady_clock::now() - sendTime);
+				else
+					++failed;
+			};
+			while (handler.doPipelinedRequest(payload, callback) == 0) { //Too many in flight
+				++arenaFullRetries;
+				handler.pollCompletions();
+				std::this_thread::yield();
+			}
+		} else {
+			while (!handler.doAsyncRequest(payload)) {
+				++arenaFullRetries;
+				std::this_thread::yield();
+			}
+		}
+		handler.pollCompletions();
+	}
+	while (handler.getPendingRequestCount() > 0) {
+		handler.pollCompletions();
+		std::this_thread::yield();
+	}
+	const auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	Transport::stopCapture();
+
+	if (!config.external) {
+		//Throughput counts what the consumer actually got, wait for it to drain the arena
+		while (consumer->getAsyncCount() + consumer->getSyncCount() + consumer->getPipelinedCount() < config.messages - failed &&
+			std::chrono::steady_clock::now() - start < std::chrono::seconds(30))
+			std::this_thread::yield();
+		stopConsumerThread();
+	}
+
+	printf("%s  messages %llu  payload %zu bytes  sync %.2f  pipelined %.2f  capabilities 0x%x  negotiated 0x%x\n",
+		config.transport.c_str(), static_cast<unsigned long long>(config.messages), config.payloadSize, config.syncRatio, config.pipelinedRatio, config.capabilities,
+		handler.getNegotiatedCapabilities());
+	printf("elapsed %.3f s  %.0f msg/s  %.2f MB/s  failed %llu  backpressure retries %llu\n",
+		elapsed, config.messages / elapsed, config.messages * config.payloadSize / elapsed / (1024 * 1024),
+		static_cast<unsigned long long>(failed), static_cast<unsigned long long>(arenaFullRetries));
+	printLatency("sync", syncLatency);
+	printLatency("pipelined", pipelinedLatency);
+	SharedMemoryHandlerInternal::TransportTelemetry telemetry;
+	if (handler.getTelemetry(telemetry)) {
+		printf("telemetry: async enqueued %llu dropped %llu high water %u bytes, sync timeouts %llu, pipelined timeouts %llu\n",
+			static_cast<unsigned long long>(telemetry.asyncEnqueued.load()), static_cast<unsigned long long>(telemetry.asyncDropped.load()),
+			telemetry.asyncHighWater.load(), static_cast<unsigned long long>(telemetry.syncTimeouts.load()),
+			static_cast<unsigned long long>(telemetry.pipelinedTimeouts.load()));
+		printf("telemetry: compressed %llu messages, saved %llu bytes\n",
+			static_cast<unsigned long long>(telemetry.asyncCompressed.load()),
+			static_cast<unsigned long long>(telemetry.asyncCompressedBytesSaved.load()));
+		const char* laneNames[] = { "control", "realtime", "bulk" };
+		for (size_t lane = 0; lane < MESSAGE_LANE_COUNT; ++lane)
+			printf("telemetry: %-8s lane enqueued %llu dropped %llu high water %u bytes\n", laneNames[lane],
+				static_cast<unsigned long long>(telemetry.laneEnqueued[lane].load()),
+				static_cast<unsigned long long>(telemetry.laneDropped[lane].load()), telemetry.laneHighWater[lane].load());
+		if (config.transport == "shm")
+			printf("telemetry: mapping%s%s, %u page faults to set it up\n",
+				telemetry.mappingMode.load() & static_cast<uint32_t>(MemMapMode::Prefault) ? " prefaulted" : " lazy",
+				telemetry.mappingMode.load() & static_cast<uint32_t>(MemMapMode::Lock) ? " locked" : "", telemetry.mappingFaults.load());
+	}
+	handler.pollCompletions(); //PipeTransport takes the last Consumed frames in there
+	SharedMemoryHandlerInternal::ConsumerTelemetry consumerTelemetry;
+	if (handler.getConsumerTelemetry(consumerTelemetry)) {
+		const char* laneNames[] = { "control", "realtime", "bulk" };
+		for (size_t lane = 0; lane < MESSAGE_LANE_COUNT; ++lane) {
+			const auto messages = consumerTelemetry.stampedMessages[lane].load();
+			if (!messages) continue;
+			printf("data age: %-8s lane %llu stamped, last %u us, average %.1f us, queue delay average %.1f us\n", laneNames[lane],
+				static_cast<unsigned long long>(messages), consumerTelemetry.lastDataAge[lane].load(),
+				static_cast<double>(consumerTelemetry.dataAgeTotal[lane].load()) / messages,
+				static_cast<double>(consumerTelemetry.queueDelayTotal[lane].load()) / messages);
+		}
+	}
+	return failed ? 2 : 0;
+}
@@ -0,0 +1,193 @@
+#include "LatencyStats.hpp"
+#include "PipeTransport.hpp"
+#include "ReferenceConsumer.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <thread>
+#include <vector>
+using namespace SharedMemoryHandlerInternal;
+
+/*
+Plays a capture recorded with Transport::startCapture (TFAR_fnc_transportCapture in game) back into a consumer.
+At --speed 1 messages are sent at the time they were recorded, higher values compress the timeline, 0 sends as fast as possible.
+Keyed async messages stay keyed, so SPEAKERS replacement behaves like in game. A full arena is retried, that is backpressure.
+"behind schedule" is how late messages went out compared to the recorded timeline, only meaningful with a speed set.
+*/
+
+struct ReplayConfig {
+	std::string capturePath;
+	double speed = 1.0;
+	uint32_t capabilities = ReferenceConsumer::defaultCapabilities;
+	std::string transport = "shm"; //"shm" or "pipe", captures don't depend on the transport they were recorded with
+	bool external = false; //Consumer is a separate tfar_reference_consumer process or a real TeamSpeak
+};
+
+static void printUsage(const char* name) {
+	fprintf(stderr,
+		"usage: %s <capture file> [options]\n"
+		"  --speed <factor>      1 replays at recorded speed, 0 as fast as possible (1)\n"
+		"  --capabilities <bits> TransportCapability bits the in process consumer announces (60)\n"
+		"  --transport <name>    shm or pipe (shm)\n"
+		"  --external            don't start a consumer, use a running one\n", name);
+}
+
+static bool parseArguments(int argc, char* argv[], ReplayConfig& config) {
+	for (int i = 1; i < argc; ++i) {
+		const bool hasValue = i + 1 < argc;
+		if (strcmp(argv[i], "--speed") == 0 && hasValue) config.speed = atof(argv[++i]);
+		else if (strcmp(argv[i], "--capabilities") == 0 && hasValue) config.capabilities = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 0));
+		else if (strcmp(argv[i], "--transport") == 0 && hasValue) config.transport = argv[++i];
+		else if (strcmp(argv[i], "--external") == 0) config.external = true;
+		else if (argv[i][0] != '-' && config.capturePath.empty()) config.capturePath = argv[i];
+		else return false;
+	}
+	return !config.capturePath.empty() && config.speed >= 0.0 && (config.transport == "shm" || config.transport == "pipe");
+}
+
+int main(int argc, char* argv[]) {
+	ReplayConfig config;
+	if (!parseArguments(argc, argv, config)) {
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	TransportCaptureReader reader;
+	if (!reader.open(config.capturePath)) {
+		fprintf(stderr, "%s\n", reader.errorMessage.c_str());
+		return 1;
+	}
+
+	auto consumer = ReferenceConsumer::create(config.transport, config.capabilities);
+	std::atomic<bool> stopConsumer{ false };
+	std::thread consumerThread;
+	if (!config.external) {
+		if (!consumer->create()) {
+			fprintf(stderr, "%s\n", consumer->errorMessage.c_str());
+			return 1;
+		}
+		consumerThread = std::thread([&consumer, &stopConsumer]() { consumer->run(stopConsumer); });
+	}
+
+	auto stopConsumerThread = [&stopConsumer, &consumerThread]() {
+		stopConsumer = true;
+		if (consumerThread.joinable())
+			consumerThread.join();
+	};
+
+	std::unique_ptr<Transport> transport;
+	if (config.transport == "pipe")
+		transport = std::make_unique<PipeTransport>();
+	else
+		transport = std::make_unique<SharedMemoryHandler>();
+	Transport& handler = *transport;
+	if (!handler.isReady()) {
+		fprintf(stderr, "Can't connect over %s %s\n", config.transport.c_str(), handler.errorMessage.c_str());
+		stopConsumerThread();
+		return 1;
+	}
+
+	std::vector<std::chrono::nanoseconds> syncLatency;
+	std::vector<std::chrono::nanoseconds> pipelinedLatency;
+	std::vector<std::chrono::nanoseconds> behindSchedule;
+	uint64_t messageCount[3] = {};
+	uint64_t bytes = 0;
+	uint64_t failed = 0;
+	uint64_t arenaFullRetries = 0;
+	std::chrono::nanoseconds captureDuration{ 0 };
+	std::string key;
+	std::string answer;
+
+	TransportCaptureReader::Record record;
+	const auto start = std::chrono::steady_clock::now();
+	while (reader.next(record)) {
+		if (record.kind > CaptureRecordKind::Pipelined) continue; //Written by a newer version
+		captureDuration = record.timestamp;
+		if (config.speed > 0.0) {
+			const auto due = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(record.timestamp / config.speed);
+			auto now = std::chrono::steady_clock::now();
+			if (due - now > 2ms)
+				std::this_thread::sleep_for(due - now - 1ms); //Sleep granularity, spin the rest
+			while ((now = std::chrono::steady_clock::now()) < due)
+				handler.pollCompletions();
+			behindSchedule.emplace_back(now - due);
+		}
+
+		const auto message = record.message;
+		bytes += message.length();
+		++messageCount[static_cast<size_t>(record.kind)];
+		switch (record.kind) {
+			case CaptureRecordKind::Async:
+				key.assign(record.key);
+				if (!key.empty()) {
+					handler.doAsyncRequest(message, key, record.lane); //Parks it if the arena is full
+					break;
+				}
+				while (!handler.doAsyncRequest(message, record.lane)) {
+					++arenaFullRetries;
+					std::this_thread::yield();
+				}
+				break;
+			case CaptureRecordKind::Sync: {
+				const auto sendTime = std::chrono::steady_clock::now();
+				if (handler.doSyncRequest(message, answer))
+					syncLatency.emplace_back(std::chrono::steady_clock::now() - sendTime);
+				else
+					++failed;
+				break;
+			}
+			case CaptureRecordKind::Pipelined: {
+				const auto sendTime = std::chrono::steady_clock::now();
+				auto callback = [&pipelinedLatency, &failed, sendTime](bool success, std::string_view) {
+					if (success)
+						pipelinedLatency.emplace_back(std::chrono::steady_clock::now() - sendTime);
+					else
+						++failed;
+				};
+				while (handler.doPipelinedRequest(message, callback, record.lane) == 0) { //Too many in flight
+					if (!handler.isCapabilityActive(TransportCapability::PipelinedRequests)) {
+						++failed;
+						break;
+					}
+					++arenaFullRetries;
+					handler.pollCompletions();
+					std::this_thread::yield();
+				}
+				break;
+			}
+		}
+		handler.pollCompletions();
+	}
+	while (handler.getPendingRequestCount() > 0) {
+		handler.pollCompletions();
+		std::this_thread::yield();
+	}
+	const auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	if (!config.external) {
+		//The consumer handles async before sync, once this is answered it has seen everything
+		handler.doSyncRequest("REPLAYEND", answer);
+		stopConsumerThread();
+	}
+
+	const auto total = messageCount[0] + messageCount[1] + messageCount[2];
+	const auto startTime = std::chrono::system_clock::to_time_t(reader.getStartTime());
+	printf("capture %s  recorded %s", config.capturePath.c_str(), ctime(&startTime));
+	printf("records %llu (async %llu sync %llu pipelined %llu)  recorded duration %.3f s  speed %.2f\n",
+		static_cast<unsigned long long>(total), static_cast<unsigned long long>(messageCount[0]),
+		static_cast<unsigned long long>(messageCount[1]), static_cast<unsigned long long>(messageCount[2]),
+		std::chrono::duration<double>(captureDuration).count(), config.speed);
+	printf("elapsed %.3f s  %.0f msg/s  %.2f MB/s  failed %llu  backpressure retries %llu\n",
+		elapsed, total / elapsed, bytes / elapsed / (1024 * 1024),
+		static_cast<unsigned long long>(failed), static_cast<unsigned long long>(arenaFullRetries));
+	if (!config.external)
+		printf("consumer received async %llu sync %llu pipelined %llu\n",
+			static_cast<unsigned long long>(consumer->getAsyncCount()),
+			static_cast<unsigned long long>(consumer->getSyncCount() - 1), //Without REPLAYEND
+			static_cast<unsigned long long>(consumer->getPipelinedCount()));
+	printLatency("behind", behindSchedule);
+	printLatency("sync", syncLatency);
+	printLatency("pipelined", pipelinedLatency);
+	return failed ? 2 : 0;
+}